@@ -0,0 +1,84 @@
+#ifndef __CLOCK_H__
+#define __CLOCK_H__
+
+/*
+ * Clock facility: monotonic time for the durations and latencies, wall
+ * time for the results and the logs. The formatted wall time prefixes
+ * are cached per thread and refreshed once per second, so a timestamp
+ * costs one clock_gettime (vDSO) and a few digits.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+// ns, monotonic, for durations only
+inline uint64_t clock_mono_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// us since the epoch
+inline uint64_t clock_wall_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// ms since the epoch, to correlate the results with other logs
+inline uint64_t clock_wall_ms()
+{
+    return clock_wall_us() / 1000;
+}
+
+struct ClockPrefix {
+    time_t second;
+    size_t len;
+    char text[24];
+};
+
+// local time of the second, formatted again when the second changed
+inline const ClockPrefix & clock_prefix(ClockPrefix &prefix, time_t second, const char *format)
+{
+    if (prefix.second != second || prefix.len == 0) {
+        struct tm r;
+        localtime_r(&second, &r);
+        prefix.len = strftime(prefix.text, sizeof(prefix.text), format, &r);
+        prefix.second = second;
+    }
+    return prefix;
+}
+
+/*
+ * "HH:MM:SS.mmm" in buffer, not terminated, returns its length.
+ * buffer must hold 16 chars.
+ */
+inline size_t clock_log_time(char *buffer)
+{
+    static thread_local ClockPrefix prefix = {0, 0, {0}};
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    const ClockPrefix &p = clock_prefix(prefix, ts.tv_sec, "%H:%M:%S");
+    memcpy(buffer, p.text, p.len);
+    long ms = ts.tv_nsec / 1000000;
+    buffer[p.len] = '.';
+    buffer[p.len + 1] = '0' + ms / 100;
+    buffer[p.len + 2] = '0' + ms / 10 % 10;
+    buffer[p.len + 3] = '0' + ms % 10;
+    return p.len + 4;
+}
+
+// "DD-MM-YYYY HH:MM:SS", terminated, buffer must hold 20 chars
+inline void clock_date_time(char *buffer)
+{
+    static thread_local ClockPrefix prefix = {0, 0, {0}};
+    const ClockPrefix &p = clock_prefix(prefix, time(NULL), "%d-%m-%Y %H:%M:%S");
+    memcpy(buffer, p.text, p.len);
+    buffer[p.len] = '\0';
+}
+
+#endif //__CLOCK_H__
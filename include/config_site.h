@@ -1,14 +1,45 @@
-// #define PJ_IOQUEUE_MAX_HANDLES 1024
-// #define FD_SETSIZE PJ_IOQUEUE_MAX_HANDLES
-//
-//
-#define PJ_IOQUEUE_MAX_HANDLES      1024
-#define FD_SETSIZE_SETABLE      1
-#define __FD_SETSIZE            1024
+/*
+ * pjsua build configuration, copy it before building pjsua:
+ *   cp include/config_site.h pjsua/pjlib/include/pj/config_site.h
+ *
+ * default: select ioqueue, up to 512 calls
+ *   ./configure
+ * high scale: epoll ioqueue, up to 32768 calls, see VP_HIGH_SCALE in CMakeLists.txt
+ *   ./configure --enable-epoll CFLAGS="-DVP_HIGH_SCALE"
+ *
+ * voip_patrol is built with the same VP_HIGH_SCALE definition and checks
+ * these limits at startup.
+ */
 
 #define PJSIP_MAX_TRANSPORTS        32
 #define PJSIP_MAX_RESOLVED_ADDRESSES    32
 
+#ifdef VP_HIGH_SCALE
+
+// epoll has no FD_SETSIZE limit, an RTP and an RTCP socket per call leg
+#define PJ_IOQUEUE_MAX_HANDLES      65536
+#define PJ_IOQUEUE_MAX_EVENTS_IN_SINGLE_POLL 256
+
+#define PJSIP_MAX_TSX_COUNT         65535
+#define PJSIP_MAX_DIALOG_COUNT      65535
+
+#define PJSUA_MAX_ACC       4096
+#define PJSUA_MAX_CALLS     32768
+#define PJSUA_MAX_PLAYERS   512
+#define PJSUA_MAX_CONF_PORTS        65536
+// audio only, every call reserves its media slots
+#define PJSUA_MAX_CALL_MEDIA        2
+
+#else
+
+#define PJ_IOQUEUE_MAX_HANDLES      1024
+#define FD_SETSIZE_SETABLE      1
+#define __FD_SETSIZE            1024
+
 #define PJSUA_MAX_ACC       512
 #define PJSUA_MAX_CALLS     512
 #define PJSUA_MAX_PLAYERS   512
+// a bridge port per call, player and recorder
+#define PJSUA_MAX_CONF_PORTS        4096
+
+#endif
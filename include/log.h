@@ -4,6 +4,9 @@
 #include <sstream>
 #include <string>
 #include <stdio.h>
+#if !(defined(WIN32) || defined(_WIN32) || defined(__WIN32__))
+#include "clock.h"
+#endif
 
 inline std::string NowTime();
 
@@ -35,7 +38,14 @@ Log<T>::Log()
 template <typename T>
 std::ostringstream& Log<T>::Get(TLogLevel level)
 {
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__)
     os << "[" << NowTime();
+#else
+    // no string is made for the time, the prefix is cached per second
+    char now[16];
+    os << '[';
+    os.write(now, clock_log_time(now));
+#endif
     os << "][" << ToString(level) << "] ";
     os << std::string(level > logDEBUG ? level - logDEBUG : 0, '\t');
     return os;
@@ -151,20 +161,10 @@ inline std::string NowTime()
 
 #else
 
-#include <sys/time.h>
-
 inline std::string NowTime()
 {
-    char buffer[11];
-    time_t t;
-    time(&t);
-    tm r = {0};
-    strftime(buffer, sizeof(buffer), "%X", localtime_r(&t, &r));
-    struct timeval tv;
-    gettimeofday(&tv, 0);
-    char result[100] = {0};
-    std::sprintf(result, "%s.%03ld", buffer, (long)tv.tv_usec / 1000); 
-    return result;
+    char buffer[16];
+    return std::string(buffer, clock_log_time(buffer));
 }
 
 #endif //WIN32
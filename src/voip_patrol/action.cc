@@ -19,6 +19,10 @@
 #include <unistd.h>
 #include "voip_patrol.hh"
 #include "action.hh"
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <random>
 
 Action::Action(Config *cfg) : config{cfg} {
 	init_actions_params();
@@ -114,11 +118,20 @@ void Action::init_actions_params() {
 	do_call_params.push_back(ActionParam("max_duration", false, APType::apt_integer));
 	do_call_params.push_back(ActionParam("min_mos", false, APType::apt_float));
 	do_call_params.push_back(ActionParam("rtp_stats", false, APType::apt_bool));
+	do_call_params.push_back(ActionParam("rtp_stats_interval", false, APType::apt_integer));
+	do_call_params.push_back(ActionParam("detect_tones", false, APType::apt_string));
+	do_call_params.push_back(ActionParam("detect_dtmf", false, APType::apt_string));
+	do_call_params.push_back(ActionParam("codecs", false, APType::apt_string));
+	do_call_params.push_back(ActionParam("tls_no_reuse", false, APType::apt_bool));
+	do_call_params.push_back(ActionParam("recording", false, APType::apt_bool));
 	do_call_params.push_back(ActionParam("hangup", false, APType::apt_randint));
 	do_call_params.push_back(ActionParam("play", false, APType::apt_string));
 	do_call_params.push_back(ActionParam("play_dtmf", false, APType::apt_string));
 	do_call_params.push_back(ActionParam("repeat", false, APType::apt_integer));
 	do_call_params.push_back(ActionParam("sps", false, APType::apt_float));
+	do_call_params.push_back(ActionParam("channels", false, APType::apt_integer));
+	do_call_params.push_back(ActionParam("total_calls", false, APType::apt_integer));
+	do_call_params.push_back(ActionParam("total_duration", false, APType::apt_integer));
 	// do_register
 	do_register_params.push_back(ActionParam("transport", false, APType::apt_string));
 	do_register_params.push_back(ActionParam("label", false, APType::apt_string));
@@ -129,6 +142,11 @@ void Action::init_actions_params() {
 	do_register_params.push_back(ActionParam("account", false, APType::apt_string));
 	do_register_params.push_back(ActionParam("password", false, APType::apt_string));
 	do_register_params.push_back(ActionParam("expected_cause_code", false, APType::apt_integer));
+	do_register_params.push_back(ActionParam("range", false, APType::apt_string));
+	do_register_params.push_back(ActionParam("file", false, APType::apt_string));
+	do_register_params.push_back(ActionParam("rps", false, APType::apt_float, "", 0, 10.0));
+	do_register_params.push_back(ActionParam("expires", false, APType::apt_integer));
+	do_register_params.push_back(ActionParam("refresh_jitter", false, APType::apt_integer));
 	// do_accept
 	do_accept_params.push_back(ActionParam("account", false, APType::apt_string));
 	do_accept_params.push_back(ActionParam("transport", false, APType::apt_string));
@@ -139,6 +157,12 @@ void Action::init_actions_params() {
 	do_accept_params.push_back(ActionParam("hangup", false, APType::apt_randint));
 	do_accept_params.push_back(ActionParam("min_mos", false, APType::apt_float));
 	do_accept_params.push_back(ActionParam("rtp_stats", false, APType::apt_bool));
+	do_accept_params.push_back(ActionParam("rtp_stats_interval", false, APType::apt_integer));
+	do_accept_params.push_back(ActionParam("detect_tones", false, APType::apt_string));
+	do_accept_params.push_back(ActionParam("detect_dtmf", false, APType::apt_string));
+	do_accept_params.push_back(ActionParam("codecs", false, APType::apt_string));
+	do_accept_params.push_back(ActionParam("tls_no_reuse", false, APType::apt_bool));
+	do_accept_params.push_back(ActionParam("recording", false, APType::apt_bool));
 	do_accept_params.push_back(ActionParam("play", false, APType::apt_string));
 	do_accept_params.push_back(ActionParam("code", false, APType::apt_integer));
 	do_accept_params.push_back(ActionParam("expected_cause_code", false, APType::apt_integer));
@@ -153,45 +177,143 @@ void Action::init_actions_params() {
 	do_alert_params.push_back(ActionParam("smtp_host", false, APType::apt_string));
 }
 
+/*
+ * 0 to max seconds. rand() is not used: the workers are forked with the same
+ * state and would pace identical jitters, the generator is seeded again in
+ * each process from its pid and the clock.
+ */
+static int refresh_jitter(int max) {
+	static std::mutex lock;
+	static std::mt19937 generator;
+	static pid_t seeded_pid = 0;
+	std::lock_guard<std::mutex> guard(lock);
+	if (seeded_pid != getpid()) {
+		seeded_pid = getpid();
+		generator.seed((uint32_t)(clock_mono_ns() ^ ((uint64_t)seeded_pid << 32) ^ seeded_pid));
+	}
+	return std::uniform_int_distribution<int>(0, max)(generator);
+}
+
+// "username,password[,account]" per line, the missing fields are the ones of the action
+static bool load_register_file(const string &file_name, const RegisterParams &defaults, vector<RegisterParams> &entries) {
+	std::ifstream file(file_name);
+	if (!file.is_open())
+		return false;
+	string line;
+	while (std::getline(file, line)) {
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+		if (line.empty() || line[0] == '#')
+			continue;
+		RegisterParams entry = defaults;
+		std::istringstream fields(line);
+		string field;
+		for (int i = 0; std::getline(fields, field, ','); i++) {
+			if (field.empty())
+				continue;
+			if (i == 0) entry.username = field;
+			else if (i == 1) entry.password = field;
+			else if (i == 2) entry.account_name = field;
+		}
+		entry.account_name = entry.account_name.empty() ? entry.username : entry.account_name;
+		entries.push_back(entry);
+	}
+	return true;
+}
+
 void Action::do_register(vector<ActionParam> &params) {
-	string type {"register"};
-	string transport {};
-	string label {};
-	string registrar {};
-	string proxy {};
-	string realm {};
-	string username {};
-	string account_name {};
-	string password {};
-	int expected_cause_code {200};
+	RegisterParams reg;
+	string range {};
+	string file {};
+	float rps {10.0};
 
 	for (auto param : params) {
-		if (param.name.compare("transport") == 0) transport = param.s_val;
-		else if (param.name.compare("label") == 0) label = param.s_val;
-		else if (param.name.compare("registrar") == 0) registrar = param.s_val;
-		else if (param.name.compare("proxy") == 0) proxy = param.s_val;
-		else if (param.name.compare("realm") == 0) realm = param.s_val;
-		else if (param.name.compare("account") == 0) account_name = param.s_val;
-		else if (param.name.compare("username") == 0) username = param.s_val;
-		else if (param.name.compare("password") == 0) password = param.s_val;
-		else if (param.name.compare("expected_cause_code") == 0) expected_cause_code = param.i_val;
+		if (param.name.compare("transport") == 0) reg.transport = param.s_val;
+		else if (param.name.compare("label") == 0) reg.label = param.s_val;
+		else if (param.name.compare("registrar") == 0) reg.registrar = param.s_val;
+		else if (param.name.compare("proxy") == 0) reg.proxy = param.s_val;
+		else if (param.name.compare("realm") == 0) reg.realm = param.s_val;
+		else if (param.name.compare("account") == 0) reg.account_name = param.s_val;
+		else if (param.name.compare("username") == 0) reg.username = param.s_val;
+		else if (param.name.compare("password") == 0) reg.password = param.s_val;
+		else if (param.name.compare("expected_cause_code") == 0) reg.expected_cause_code = param.i_val;
+		else if (param.name.compare("range") == 0) range = param.s_val;
+		else if (param.name.compare("file") == 0) file = param.s_val;
+		else if (param.name.compare("rps") == 0) rps = param.f_val;
+		else if (param.name.compare("expires") == 0) reg.expires = param.i_val;
+		else if (param.name.compare("refresh_jitter") == 0) reg.refresh_jitter = param.i_val;
 	}
 
-	if (username.empty() || realm.empty() || password.empty() || registrar.empty()) {
-		LOG(logERROR) <<__FUNCTION__<<" missing action parameter" ;
+	if (range.empty() && file.empty()) {
+		if (reg.username.empty() || reg.realm.empty() || reg.password.empty() || reg.registrar.empty()) {
+			LOG(logERROR) <<__FUNCTION__<<" missing action parameter" ;
+			return;
+		}
+		if (reg.account_name.empty()) reg.account_name = reg.username;
+		register_account(reg);
 		return;
 	}
 
-	if (account_name.empty()) account_name = username;
+	// bulk registration, paced at rps
+	RegisterGenerator *generator = new RegisterGenerator(config);
+	generator->params = reg;
+	int count = 0;
+	if (!file.empty()) {
+		if (!load_register_file(file, reg, generator->entries)) {
+			LOG(logERROR) <<__FUNCTION__<<": can not read file["<<file<<"]";
+			delete generator;
+			return;
+		}
+		count = generator->entries.size();
+	} else {
+		size_t dash = range.find('-');
+		if (dash == string::npos || reg.username.find("{n}") == string::npos) {
+			LOG(logERROR) <<__FUNCTION__<<": range["<<range<<"] is first-last and username must contain {n}";
+			delete generator;
+			return;
+		}
+		string first = range.substr(0, dash);
+		generator->range_first = atoi(first.c_str());
+		generator->range_last = atoi(range.substr(dash + 1).c_str());
+		// "0001-2000" keeps the leading zeros
+		generator->range_width = first.size() > 1 && first[0] == '0' ? first.size() : 0;
+		count = generator->range_last - generator->range_first + 1;
+	}
+	if (reg.realm.empty() || reg.registrar.empty() || count <= 0) {
+		LOG(logERROR) <<__FUNCTION__<<" missing action parameter or no account to register" ;
+		delete generator;
+		return;
+	}
+	// with --workers every worker registers its share of the accounts, the limit is per process
+	int share = config->workerShare(count);
+	if (share > PJSUA_MAX_ACC - (int)config->accountCount()) {
+		LOG(logERROR) <<__FUNCTION__<<": accounts["<<share<<"/"<<count<<"] above the max accounts["<<PJSUA_MAX_ACC
+		              <<"] of the pjsua build, see VP_HIGH_SCALE and --workers";
+		delete generator;
+		return;
+	}
+	generator->total = share;
+	generator->sps = rps / config->worker_count;
+	if (generator->total == 0) {
+		delete generator;
+		return;
+	}
+	config->generators.push_back(generator);
+	generator->start();
+}
+
+bool Action::register_account(const RegisterParams &reg, RegisterGenerator *generator) {
+	string type {"register"};
 	Test *test = new Test(config, type);
-	test->local_user = username;
-	test->remote_user = username;
-	test->label = label;
-	test->expected_cause_code = expected_cause_code;
-	test->from = username;
+	test->local_user = reg.username;
+	test->remote_user = reg.username;
+	test->label = reg.label;
+	test->expected_cause_code = reg.expected_cause_code;
+	test->from = reg.username;
 	test->type = type;
+	test->register_generator = generator;
 
-	LOG(logINFO) <<__FUNCTION__<< " sip:" + account_name + "@" + registrar  ;
+	LOG(logINFO) <<__FUNCTION__<< " sip:" + reg.account_name + "@" + reg.registrar  ;
 	AccountConfig acc_cfg;
 	SipHeader sh;
 	sh.hName = "User-Agent";
@@ -199,41 +321,62 @@ void Action::do_register(vector<ActionParam> &params) {
 	acc_cfg.regConfig.headers.push_back(sh);
 
 	acc_cfg.sipConfig.transportId = config->transport_id_udp;
-	if (!transport.empty()) {
-		if (transport.compare("tcp") == 0) {
+	if (!reg.transport.empty()) {
+		if (reg.transport.compare("tcp") == 0) {
 			acc_cfg.sipConfig.transportId = config->transport_id_tcp;
-		} else if (transport.compare("tls") == 0) {
+		} else if (reg.transport.compare("tls") == 0) {
 			if (config->transport_id_tls == -1) {
 				LOG(logERROR) <<__FUNCTION__<<" TLS transport not supported";
-				return;
+				delete test;
+				return false;
 			}
 			acc_cfg.sipConfig.transportId = config->transport_id_tls;
 		}
 	}
 	if (acc_cfg.sipConfig.transportId == config->transport_id_tls) {
-		acc_cfg.idUri = "sips:" + account_name + "@" + registrar;
-		acc_cfg.regConfig.registrarUri = "sips:" + registrar;
-		if (!proxy.empty())
-			acc_cfg.sipConfig.proxies.push_back("sips:" + proxy);
+		acc_cfg.idUri = "sips:" + reg.account_name + "@" + reg.registrar;
+		acc_cfg.regConfig.registrarUri = "sips:" + reg.registrar;
+		if (!reg.proxy.empty())
+			acc_cfg.sipConfig.proxies.push_back("sips:" + reg.proxy);
 
 		LOG(logINFO) <<__FUNCTION__<< " SIPS URI Scheme";
 	} else {
 		LOG(logINFO) <<__FUNCTION__<< " SIP URI Scheme";
-		acc_cfg.idUri = "sip:" + account_name + "@" + registrar;
-		acc_cfg.regConfig.registrarUri = "sip:" + registrar;
-		if (!proxy.empty())
-			acc_cfg.sipConfig.proxies.push_back("sip:" + proxy);
+		acc_cfg.idUri = "sip:" + reg.account_name + "@" + reg.registrar;
+		acc_cfg.regConfig.registrarUri = "sip:" + reg.registrar;
+		if (!reg.proxy.empty())
+			acc_cfg.sipConfig.proxies.push_back("sip:" + reg.proxy);
 
 	}
-	acc_cfg.sipConfig.authCreds.push_back( AuthCredInfo("digest", realm, username, 0, password) );
+	acc_cfg.sipConfig.authCreds.push_back( AuthCredInfo("digest", reg.realm, reg.username, 0, reg.password) );
+	if (reg.expires > 0)
+		acc_cfg.regConfig.timeoutSec = reg.expires;
+	if (reg.refresh_jitter > 0) {
+		// accounts registered together do not refresh together, the period of each
+		// account differs so that they drift apart instead of staying aligned
+		int jitter = std::min(reg.refresh_jitter, (int)acc_cfg.regConfig.timeoutSec / 2);
+		if (jitter > 0)
+			acc_cfg.regConfig.delayBeforeRefreshSec += refresh_jitter(jitter);
+	}
 
-	TestAccount *acc = config->findAccount(account_name);
-	if (!acc) {
-		acc = config->createAccount(acc_cfg);
-	} else {
-		acc->modify(acc_cfg);
+	// the REGISTER is sent by create or modify, the test is set before the response
+	test->register_ns = clock_mono_ns();
+	TestAccount *acc = config->findAccount(reg.account_name);
+	try {
+		if (!acc) {
+			config->createAccount(acc_cfg, test);
+		} else {
+			acc->setTest(test);
+			config->modifyAccount(acc, acc_cfg);
+		}
+	} catch (pj::Error &err) {
+		LOG(logERROR) <<__FUNCTION__<<": ["<<reg.account_name<<"] "<<err.info();
+		if (acc && acc->test == test)
+			acc->setTest(NULL);
+		delete test;
+		return false;
 	}
-	acc->setTest(test);
+	return true;
 }
 
 void Action::do_accept(vector<ActionParam> &params) {
@@ -249,6 +392,12 @@ void Action::do_accept(vector<ActionParam> &params) {
 	int hangup_duration {0};
 	call_state_t wait_until {INV_STATE_NULL};
 	bool rtp_stats {false};
+	int rtp_stats_interval {0};
+	vector<unsigned> detect_tones {};
+	string detect_dtmf {};
+	vector<string> codecs {};
+	bool tls_no_reuse {false};
+	bool recording {false};
 	int code {200};
 	int expected_cause_code {200};
 	string reason {};
@@ -266,6 +415,12 @@ void Action::do_accept(vector<ActionParam> &params) {
 		else if (param.name.compare("ring_duration") == 0) ring_duration = param.i_val;
 		else if (param.name.compare("min_mos") == 0) min_mos = param.f_val;
 		else if (param.name.compare("rtp_stats") == 0) rtp_stats = param.b_val;
+		else if (param.name.compare("rtp_stats_interval") == 0) rtp_stats_interval = param.i_val;
+		else if (param.name.compare("detect_tones") == 0) detect_tones = parse_tone_list(param.s_val);
+		else if (param.name.compare("detect_dtmf") == 0) detect_dtmf = param.s_val;
+		else if (param.name.compare("codecs") == 0) codecs = parse_codec_list(param.s_val);
+		else if (param.name.compare("tls_no_reuse") == 0) tls_no_reuse = param.b_val;
+		else if (param.name.compare("recording") == 0) recording = param.b_val;
 		else if (param.name.compare("wait_until") == 0) wait_until = get_call_state_from_string(param.s_val);
 		else if (param.name.compare("hangup") == 0) hangup_duration = param.i_val;
 	}
@@ -302,6 +457,13 @@ void Action::do_accept(vector<ActionParam> &params) {
 	acc->ring_duration = ring_duration;
 	acc->accept_label = label;
 	acc->rtp_stats = rtp_stats;
+	acc->rtp_stats_interval = rtp_stats_interval;
+	acc->detect_tones = detect_tones;
+	acc->detect_dtmf = detect_dtmf;
+	acc->codecs = codecs;
+	acc->tls_no_reuse = tls_no_reuse;
+	acc->recording = recording;
+	acc->min_mos = min_mos;
 	acc->play = play;
 	acc->play_dtmf = play_dtmf;
 	acc->wait_state = wait_until;
@@ -330,9 +492,16 @@ void Action::do_call(vector<ActionParam> &params, SipHeaderVector &x_headers) {
 	int hangup_duration {0};
 	int repeat {0};
 	float sps {1.0};
-	int interval {1000};
+	int channels {0};
+	int total_calls {0};
+	int total_duration {0};
 	bool recording {false};
 	bool rtp_stats {false};
+	int rtp_stats_interval {0};
+	vector<unsigned> detect_tones {};
+	string detect_dtmf {};
+	vector<string> codecs {};
+	bool tls_no_reuse {false};
 
 	for (auto param : params) {
 		if (param.name.compare("callee") == 0) callee = param.s_val;
@@ -348,17 +517,21 @@ void Action::do_call(vector<ActionParam> &params, SipHeaderVector &x_headers) {
 		else if (param.name.compare("wait_until") == 0) wait_until = get_call_state_from_string(param.s_val);
 		else if (param.name.compare("min_mos") == 0) min_mos = param.f_val;
 		else if (param.name.compare("rtp_stats") == 0) rtp_stats = param.b_val;
+		else if (param.name.compare("rtp_stats_interval") == 0) rtp_stats_interval = param.i_val;
+		else if (param.name.compare("detect_tones") == 0) detect_tones = parse_tone_list(param.s_val);
+		else if (param.name.compare("detect_dtmf") == 0) detect_dtmf = param.s_val;
+		else if (param.name.compare("codecs") == 0) codecs = parse_codec_list(param.s_val);
+		else if (param.name.compare("tls_no_reuse") == 0) tls_no_reuse = param.b_val;
 		else if (param.name.compare("max_duration") == 0) max_duration = param.i_val;
 		else if (param.name.compare("max_calling_duration") == 0) max_calling_duration = param.i_val;
 		else if (param.name.compare("duration") == 0) expected_duration = param.i_val;
 		else if (param.name.compare("hangup") == 0) hangup_duration = param.i_val;
 		else if (param.name.compare("repeat") == 0) repeat = param.i_val;
 		else if (param.name.compare("sps") == 0) sps = param.f_val;
-		else if (param.name.compare("recording") == 0) recording = true;
-	}
-
-	if (repeat) {
-		interval = 1000/sps;
+		else if (param.name.compare("channels") == 0) channels = param.i_val;
+		else if (param.name.compare("total_calls") == 0) total_calls = param.i_val;
+		else if (param.name.compare("total_duration") == 0) total_duration = param.i_val;
+		else if (param.name.compare("recording") == 0) recording = param.b_val;
 	}
 
 	if (caller.empty() || callee.empty()) {
@@ -397,71 +570,56 @@ void Action::do_call(vector<ActionParam> &params, SipHeaderVector &x_headers) {
 		acc = config->createAccount(acc_cfg);
 	}
 
-	do {
-		Test *test = new Test(config, type);
-		test->wait_state = wait_until;
-		if (test->wait_state != INV_STATE_NULL)
-			test->state = VPT_RUN_WAIT;
-		test->expected_duration = expected_duration;
-		test->label = label;
-		test->play = play;
-		test->play_dtmf = play_dtmf;
-		test->min_mos = min_mos;
-		test->max_duration = max_duration;
-		test->max_calling_duration = max_calling_duration;
-		test->hangup_duration = hangup_duration;
-		test->recording = recording;
-		test->rtp_stats = rtp_stats;
-		std::size_t pos = caller.find("@");
-		if (pos!=std::string::npos) {
-			test->local_user = caller.substr(0, pos);
-		}
-		pos = callee.find("@");
-		if (pos!=std::string::npos) {
-			test->remote_user = callee.substr(0, pos);
-		}
-
-		TestCall *call = new TestCall(acc);
-		config->calls.push_back(call);
-
-		call->test = test;
-		test->expected_cause_code = expected_cause_code;
-		test->from = caller;
-		test->to = callee;
-		test->type = type;
-		acc->calls.push_back(call);
-		CallOpParam prm(true);
-
-		for (auto x_hdr : x_headers) {
-			prm.txOption.headers.push_back(x_hdr);
-		}
-
-		prm.opt.audioCount = 1;
-		prm.opt.videoCount = 0;
-		LOG(logINFO) << "call->test:" << test << " " << call->test->type;
-		LOG(logINFO) << "calling :" +callee;
-		if (transport.compare("tls") == 0) {
-			try {
-				call->makeCall("sips:"+callee, prm);
-			} catch (pj::Error e)  {
-				LOG(logERROR) <<__FUNCTION__<<" error :" << e.status << std::endl;
-			}
-		} else if (transport.compare("tcp") == 0) {
-			try {
-				call->makeCall("sip:"+callee+";transport=tcp", prm);
-			} catch (pj::Error e)  {
-				LOG(logERROR) <<__FUNCTION__<<" error :" << e.status << std::endl;
-			}
-		} else {
-			try {
-				call->makeCall("sip:"+callee, prm);
-			} catch (pj::Error e)  {
-				LOG(logERROR) <<__FUNCTION__<<" error :" << e.status << std::endl;
-			}
-		}
-		repeat--;
-		pj_thread_sleep(interval);
-	} while (repeat >= 0);
+	CallGenerator *generator = new CallGenerator(config, acc);
+	generator->type = type;
+	generator->play = play;
+	generator->play_dtmf = play_dtmf;
+	generator->caller = caller;
+	generator->callee = callee;
+	generator->transport = transport;
+	generator->label = label;
+	generator->expected_cause_code = expected_cause_code;
+	generator->wait_until = wait_until;
+	generator->min_mos = min_mos;
+	generator->max_duration = max_duration;
+	generator->max_calling_duration = max_calling_duration;
+	generator->expected_duration = expected_duration;
+	generator->hangup_duration = hangup_duration;
+	generator->recording = recording;
+	generator->rtp_stats = rtp_stats;
+	generator->rtp_stats_interval = rtp_stats_interval;
+	generator->detect_tones = detect_tones;
+	generator->detect_dtmf = detect_dtmf;
+	generator->codecs = codecs;
+	generator->tls_no_reuse = tls_no_reuse;
+	generator->x_headers = x_headers;
+	// with --workers every worker makes its share of the calls
+	generator->total = config->workerShare(repeat + 1);
+	generator->sps = sps / config->worker_count;
+	if (channels > 0) {
+		// keep the channels busy until total_calls or total_duration is reached
+		generator->channels = config->workerShare(channels);
+		generator->total = config->workerShare(total_calls);
+		generator->duration = total_duration;
+	}
+	if (config->max_calls && generator->channels > (int)config->max_calls) {
+		LOG(logERROR) <<__FUNCTION__<<": channels["<<generator->channels<<"] above the max calls["<<config->max_calls
+		              <<"] of the pjsua build, see VP_HIGH_SCALE";
+		delete generator;
+		return;
+	}
+	if (config->max_calls && channels <= 0 && generator->sps * hangup_duration > config->max_calls) {
+		LOG(logWARNING) <<__FUNCTION__<<": about ["<<(int)(generator->sps * hangup_duration)<<"] calls in progress above the max calls["
+		                <<config->max_calls<<"] of the pjsua build, see VP_HIGH_SCALE";
+	}
+	bool idle = channels > 0 ? generator->channels == 0 || (total_calls > 0 && generator->total == 0) : generator->total == 0;
+	if (idle) {
+		LOG(logINFO) <<__FUNCTION__<<": no call left for worker["<<config->worker_index<<"] label["<<label<<"]";
+		delete generator;
+		return;
+	}
+	config->generators.push_back(generator);
+	generator->start();
 }
 
 void Action::do_alert(vector<ActionParam> &params) {
@@ -487,106 +645,22 @@ void Action::do_wait(vector<ActionParam> &params) {
 		if (param.name.compare("complete") == 0) complete_all = param.b_val;
 	}
 	LOG(logINFO) << __FUNCTION__ << " duration_ms:" << duration_ms << " complete all tests:" << complete_all;
-	bool completed = false;
-	int tests_running = 0;
+	auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(duration_ms > 0 ? duration_ms : 0);
 	bool status_update = true;
-	while (!completed) {
-		for (auto & account : config->accounts) {
-			AccountInfo acc_inf = account->getInfo();
-			if (account->test && account->test->state == VPT_DONE){
-				delete account->test;
-				account->test = NULL;
-			} else if (account->test) {
-				tests_running++;
-			}
-		}
-		for (auto & call : config->calls) {
-			if (call->test && call->test->state == VPT_DONE){
-				//LOG(logINFO) << "delete call test["<<call->test<<"]";
-				//delete call->test;
-				//call->test = NULL;
-				//removeCall(call);
-			} else if (call->test) {
-				CallInfo ci = call->getInfo();
-				if (status_update) {
-					LOG(logDEBUG) <<__FUNCTION__<<": [call]["<<call->getId()<<"][test]["<<(ci.role==0?"CALLER":"CALLEE")<<"]["
-						     << ci.callIdString <<"]["<<ci.remoteUri<<"]["<<ci.stateText<<"|"<<ci.state<<"]duration["
-						     << ci.connectDuration.sec <<">="<<call->test->hangup_duration<<"]";
-				}
-				if (ci.state == PJSIP_INV_STATE_CALLING || ci.state == PJSIP_INV_STATE_EARLY)  {
-					Test *test = call->test;
-					if (test->ring_duration > 0 && ci.totalDuration.sec >= test->ring_duration) {
-						CallOpParam prm;
-						if (test->reason.size() > 0) prm.reason = test->reason;
-						if (test->code) prm.statusCode = test->code;
-						call->answer(prm);
-					} else if (test->max_calling_duration && test->max_calling_duration <= ci.totalDuration.sec) {
-						LOG(logINFO) <<__FUNCTION__<<"[cancelling:call]["<<call->getId()<<"][test]["<<(ci.role==0?"CALLER":"CALLEE")<<"]["
-						     << ci.callIdString <<"]["<<ci.remoteUri<<"]["<<ci.stateText<<"|"<<ci.state<<"]duration["
-						     << ci.totalDuration.sec <<">="<<test->max_calling_duration<<"]";
-						CallOpParam prm(true);
-						try {
-							call->hangup(prm);
-						} catch (pj::Error e)  {
-							if (e.status != 171140) LOG(logERROR) <<__FUNCTION__<<" error :" << e.status;
-						}
-					}
-				} else if (ci.state == PJSIP_INV_STATE_CONFIRMED) {
-					std::string res = "call[" + std::to_string(ci.lastStatusCode) + "] reason["+ ci.lastReason +"]";
-					call->test->connect_duration = ci.connectDuration.sec;
-					call->test->setup_duration = ci.totalDuration.sec - ci.connectDuration.sec;
-					call->test->result_cause_code = (int)ci.lastStatusCode;
-					call->test->reason = ci.lastReason;
-					if (call->test->hangup_duration && ci.connectDuration.sec >= call->test->hangup_duration){
-						if (ci.state == PJSIP_INV_STATE_CONFIRMED) {
-							CallOpParam prm(true);
-							LOG(logINFO) << "hangup : call in PJSIP_INV_STATE_CONFIRMED" ;
-							try {
-								call->hangup(prm);
-							} catch (pj::Error e)  {
-								if (e.status != 171140) LOG(logERROR) <<__FUNCTION__<<" error :" << e.status << std::endl;
-							}
-						}
-						call->test->update_result();
-					}
-				}
-				if (complete_all || call->test->state == VPT_RUN_WAIT)
-					tests_running++;
-			}
-		}
-
-		int pos=0;
-		for (auto test : config->tests_with_rtp_stats) {
-			if (test->rtp_stats_ready) {
-				test->update_result();
-				config->tests_with_rtp_stats.erase(config->tests_with_rtp_stats.begin()+pos);
-				LOG(logINFO) << __FUNCTION__ << " erase pos:" << pos;
-			} else {
-				pos++;
- 			}
-		}
-
-		if (tests_running > 0) {
-			if (status_update) {
-				LOG(logINFO) <<__FUNCTION__<<LOG_COLOR_ERROR<<": action[wait] active account tests or call tests in run_wait["<<tests_running<<"] <<<<"<<LOG_COLOR_END;
-				status_update = false;
-			}
-			tests_running=0;
-
-			if (duration_ms > 0) duration_ms -= 100;
-			pj_thread_sleep(100);
-		} else {
-			if (duration_ms > 0) {
-				duration_ms -= 10;
-				pj_thread_sleep(10);
-				continue;
-			} else if (duration_ms == -1) {
-				pj_thread_sleep(10);
-				continue;
-			}
-
-			completed = true;
-			LOG(logINFO) <<__FUNCTION__<<": completed";
+	std::unique_lock<std::mutex> lock(config->wait_mutex);
+	while (true) {
+		int tests_running = config->testsRunning(complete_all);
+		if (tests_running > 0 && status_update) {
+			LOG(logINFO) <<__FUNCTION__<<LOG_COLOR_ERROR<<": action[wait] active account tests or call tests in run_wait["<<tests_running<<"] <<<<"<<LOG_COLOR_END;
+			status_update = false;
 		}
+		if (tests_running == 0 && duration_ms != -1 && std::chrono::steady_clock::now() >= end)
+			break;
+		// sleep until a test changes state
+		if (tests_running == 0 && duration_ms > 0)
+			config->wait_cond.wait_until(lock, end);
+		else
+			config->wait_cond.wait(lock);
 	}
+	LOG(logINFO) <<__FUNCTION__<<": completed";
 }
@@ -43,6 +43,23 @@ struct ActionParam {
 	bool required;
 };
 
+class RegisterGenerator;
+
+/* account and registrar of a register action */
+struct RegisterParams {
+	string label;
+	string transport;
+	string registrar;
+	string proxy;
+	string realm;
+	string username;
+	string account_name;
+	string password;
+	int expected_cause_code {200};
+	int expires {0};          // s, 0: pjsua default
+	int refresh_jitter {0};   // s, each account refreshes up to this much earlier
+};
+
 class Action {
 	public:
 			Action(Config *cfg);
@@ -53,6 +70,8 @@ class Action {
 			void do_accept(vector<ActionParam> &params);
 			void do_wait(vector<ActionParam> &params);
 			void do_register(vector<ActionParam> &params);
+			// creates or updates the account, registered with a new register test
+			bool register_account(const RegisterParams &params, RegisterGenerator *generator=nullptr);
 			void do_alert(vector<ActionParam> &params);
 			void set_config(Config *);
 			Config* get_config();
@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2016-2018 Julien Chavanton <jchavanton@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA~
+ */
+
+#include "dsp.hh"
+#include <cmath>
+#include <cstring>
+
+#define DSP_PI 3.14159265358979323846f
+
+void dsp_filterbank_init(dsp_filterbank *fb, unsigned clock_rate, float low_hz, float high_hz) {
+	memset(fb, 0, sizeof(*fb));
+	// log spaced centers, roughly one critical band wide each
+	float ratio = powf(high_hz / low_hz, 1.0f / (DSP_BANDS - 1));
+	float q = sqrtf(ratio) / (ratio - 1.0f);
+	float center = low_hz;
+	for (int b = 0; b < DSP_BANDS; b++) {
+		float w0 = 2.0f * DSP_PI * center / clock_rate;
+		float alpha = sinf(w0) / (2.0f * q);
+		float a0 = 1.0f + alpha;
+		fb->b0[b] = alpha / a0;
+		fb->b2[b] = -alpha / a0;
+		fb->a1[b] = -2.0f * cosf(w0) / a0;
+		fb->a2[b] = (1.0f - alpha) / a0;
+		center *= ratio;
+	}
+}
+
+void dsp_filterbank_energy(dsp_filterbank *fb, const float *in, size_t len, size_t hop, float *out) {
+	float z1[DSP_BANDS], z2[DSP_BANDS], acc[DSP_BANDS];
+	memcpy(z1, fb->z1, sizeof(z1));
+	memcpy(z2, fb->z2, sizeof(z2));
+	size_t frames = len / hop;
+	for (size_t f = 0; f < frames; f++) {
+		for (int b = 0; b < DSP_BANDS; b++)
+			acc[b] = 0.0f;
+		const float *x = in + f * hop;
+		for (size_t i = 0; i < hop; i++) {
+			float s = x[i];
+			// transposed direct form II, b1 is 0 for a band-pass, the bands are the vector lanes
+			for (int b = 0; b < DSP_BANDS; b++) {
+				float y = fb->b0[b] * s + z1[b];
+				z1[b] = -fb->a1[b] * y + z2[b];
+				z2[b] = fb->b2[b] * s - fb->a2[b] * y;
+				acc[b] += y * y;
+			}
+		}
+		float *o = out + f * DSP_BANDS;
+		for (int b = 0; b < DSP_BANDS; b++)
+			o[b] = acc[b] / hop;
+	}
+	memcpy(fb->z1, z1, sizeof(z1));
+	memcpy(fb->z2, z2, sizeof(z2));
+}
+
+void dsp_goertzel_init(dsp_goertzel *g, unsigned clock_rate, const float *freqs, unsigned count) {
+	memset(g, 0, sizeof(*g));
+	if (count > DSP_TONES)
+		count = DSP_TONES;
+	for (unsigned t = 0; t < count; t++)
+		g->coeff[t] = 2.0f * cosf(2.0f * DSP_PI * freqs[t] / clock_rate);
+	g->count = count;
+}
+
+void dsp_goertzel_power(const dsp_goertzel *g, const float *in, size_t len, float *out) {
+	float s1[DSP_TONES], s2[DSP_TONES];
+	for (int t = 0; t < DSP_TONES; t++)
+		s1[t] = s2[t] = 0.0f;
+	// every lane is computed, the unused ones have a 0 coefficient
+	for (size_t i = 0; i < len; i++) {
+		float x = in[i];
+		for (int t = 0; t < DSP_TONES; t++) {
+			float s = x + g->coeff[t] * s1[t] - s2[t];
+			s2[t] = s1[t];
+			s1[t] = s;
+		}
+	}
+	for (int t = 0; t < DSP_TONES; t++)
+		out[t] = s1[t] * s1[t] + s2[t] * s2[t] - g->coeff[t] * s1[t] * s2[t];
+}
+
+void dsp_int16_to_float(const int16_t *in, float *out, size_t len) {
+	for (size_t i = 0; i < len; i++)
+		out[i] = in[i] * (1.0f / 32768.0f);
+}
+
+float dsp_dot(const float *a, const float *b, size_t len) {
+	float sum = 0.0f;
+	for (size_t i = 0; i < len; i++)
+		sum += a[i] * b[i];
+	return sum;
+}
+
+float dsp_energy(const float *a, size_t len) {
+	return dsp_dot(a, a, len);
+}
+
+void dsp_scale(float *a, float gain, size_t len) {
+	for (size_t i = 0; i < len; i++)
+		a[i] *= gain;
+}
+
+void dsp_xcorr(const float *a, const float *b, size_t len, size_t lags, float *out) {
+	for (size_t lag = 0; lag < lags; lag++)
+		out[lag] = dsp_dot(a, b + lag, len);
+}
+
+void dsp_to_db(const float *in, float *out, size_t len, float floor) {
+	for (size_t i = 0; i < len; i++)
+		out[i] = 10.0f * log10f(in[i] + floor);
+}
+
+float dsp_pearson(const float *a, const float *b, size_t len) {
+	if (len < 2)
+		return 0.0f;
+	float sa = 0.0f, sb = 0.0f, saa = 0.0f, sbb = 0.0f, sab = 0.0f;
+	for (size_t i = 0; i < len; i++) {
+		sa += a[i];
+		sb += b[i];
+		saa += a[i] * a[i];
+		sbb += b[i] * b[i];
+		sab += a[i] * b[i];
+	}
+	float n = (float)len;
+	float cov = sab - sa * sb / n;
+	float va = saa - sa * sa / n;
+	float vb = sbb - sb * sb / n;
+	if (va <= 0.0f || vb <= 0.0f)
+		return 0.0f;
+	return cov / sqrtf(va * vb);
+}
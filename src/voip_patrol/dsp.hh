@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2016-2018 Julien Chavanton <jchavanton@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA~
+ */
+
+#ifndef VOIP_PATROL_DSP_H
+#define VOIP_PATROL_DSP_H
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Signal processing kernels, written as plain loops over contiguous
+ * float arrays so that the compiler vectorizes them, dsp.cc is built
+ * with its own optimization flags (see CMakeLists.txt).
+ */
+
+#define DSP_BANDS 16
+#define DSP_TONES 16
+
+/* band-pass biquads in structure of arrays layout, one lane per band */
+struct dsp_filterbank {
+	float b0[DSP_BANDS], b2[DSP_BANDS], a1[DSP_BANDS], a2[DSP_BANDS];
+	float z1[DSP_BANDS], z2[DSP_BANDS];
+};
+
+void dsp_filterbank_init(dsp_filterbank *fb, unsigned clock_rate, float low_hz, float high_hz);
+
+/* energy of every band for each hop of the signal, out holds (len / hop) * DSP_BANDS values */
+void dsp_filterbank_energy(dsp_filterbank *fb, const float *in, size_t len, size_t hop, float *out);
+
+/* Goertzel filters in structure of arrays layout, one lane per frequency */
+struct dsp_goertzel {
+	float coeff[DSP_TONES];
+	unsigned count;
+};
+
+void dsp_goertzel_init(dsp_goertzel *g, unsigned clock_rate, const float *freqs, unsigned count);
+
+/* power of every frequency over the block, out holds DSP_TONES values */
+void dsp_goertzel_power(const dsp_goertzel *g, const float *in, size_t len, float *out);
+
+void dsp_int16_to_float(const int16_t *in, float *out, size_t len);
+float dsp_dot(const float *a, const float *b, size_t len);
+float dsp_energy(const float *a, size_t len);
+void dsp_scale(float *a, float gain, size_t len);
+/* out[lag] = dot(a, b + lag), lag in [0, lags) */
+void dsp_xcorr(const float *a, const float *b, size_t len, size_t lags, float *out);
+/* 10 * log10(in + floor) */
+void dsp_to_db(const float *in, float *out, size_t len, float floor);
+float dsp_pearson(const float *a, const float *b, size_t len);
+
+#endif
@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2016-2018 Julien Chavanton <jchavanton@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA~
+ */
+
+#include "json.hh"
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+
+/*
+ * JsonWriter implementation
+ */
+
+JsonWriter::JsonWriter(size_t reserve) : not_first(0), depth(0) {
+	buffer.reserve(reserve);
+}
+
+void JsonWriter::clear() {
+	buffer.clear();
+	not_first = 0;
+	depth = 0;
+}
+
+void JsonWriter::separator() {
+	uint64_t bit = (uint64_t)1 << depth;
+	if (not_first & bit)
+		buffer.append(", ", 2);
+	else
+		not_first |= bit;
+}
+
+void JsonWriter::key(const char *key) {
+	separator();
+	buffer += '"';
+	escape(buffer, key, strlen(key));
+	buffer.append("\": ", 3);
+}
+
+void JsonWriter::begin_object() {
+	if (depth > 0)
+		separator();
+	buffer += '{';
+	depth++;
+	not_first &= ~((uint64_t)1 << depth);
+}
+
+void JsonWriter::begin_object(const char *p_key) {
+	key(p_key);
+	buffer += '{';
+	depth++;
+	not_first &= ~((uint64_t)1 << depth);
+}
+
+void JsonWriter::end_object() {
+	buffer += '}';
+	if (depth > 0)
+		depth--;
+}
+
+void JsonWriter::begin_array(const char *p_key) {
+	key(p_key);
+	buffer += '[';
+	depth++;
+	not_first &= ~((uint64_t)1 << depth);
+}
+
+void JsonWriter::end_array() {
+	buffer += ']';
+	if (depth > 0)
+		depth--;
+}
+
+void JsonWriter::add_value(long long value) {
+	char num[24];
+	int len = snprintf(num, sizeof(num), "%lld", value);
+	separator();
+	buffer.append(num, len);
+}
+
+void JsonWriter::add_value(double value) {
+	separator();
+	append_double(value);
+}
+
+void JsonWriter::add(const char *p_key, const std::string &value) {
+	key(p_key);
+	buffer += '"';
+	escape(buffer, value.data(), value.size());
+	buffer += '"';
+}
+
+void JsonWriter::add(const char *p_key, const char *value) {
+	key(p_key);
+	buffer += '"';
+	if (value)
+		escape(buffer, value, strlen(value));
+	buffer += '"';
+}
+
+void JsonWriter::add_int(const char *p_key, long long value) {
+	char num[24];
+	int len = snprintf(num, sizeof(num), "%lld", value);
+	key(p_key);
+	buffer.append(num, len);
+}
+
+void JsonWriter::add_uint(const char *p_key, unsigned long long value) {
+	char num[24];
+	int len = snprintf(num, sizeof(num), "%llu", value);
+	key(p_key);
+	buffer.append(num, len);
+}
+
+void JsonWriter::add(const char *p_key, int value) { add_int(p_key, value); }
+void JsonWriter::add(const char *p_key, long value) { add_int(p_key, value); }
+void JsonWriter::add(const char *p_key, long long value) { add_int(p_key, value); }
+void JsonWriter::add(const char *p_key, unsigned value) { add_uint(p_key, value); }
+void JsonWriter::add(const char *p_key, unsigned long value) { add_uint(p_key, value); }
+void JsonWriter::add(const char *p_key, unsigned long long value) { add_uint(p_key, value); }
+
+void JsonWriter::append_double(double value) {
+	char num[32];
+	int len;
+	// NaN and infinity are not valid JSON numbers
+	if (std::isfinite(value))
+		len = snprintf(num, sizeof(num), "%f", value);
+	else
+		len = snprintf(num, sizeof(num), "null");
+	buffer.append(num, len);
+}
+
+void JsonWriter::add(const char *p_key, double value) {
+	key(p_key);
+	append_double(value);
+}
+
+void JsonWriter::add(const char *p_key, bool value) {
+	key(p_key);
+	if (value)
+		buffer.append("true", 4);
+	else
+		buffer.append("false", 5);
+}
+
+void JsonWriter::add_raw(const char *p_key, const std::string &json) {
+	key(p_key);
+	buffer.append(json);
+}
+
+void JsonWriter::escape(std::string &out, const char *str, size_t len) {
+	static const char hex[] = "0123456789abcdef";
+	size_t start = 0;
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = str[i];
+		if (c >= 0x20 && c != '"' && c != '\\')
+			continue;
+		// copy the run of characters that did not need escaping
+		out.append(str + start, i - start);
+		start = i + 1;
+		switch (c) {
+			case '"': out.append("\\\"", 2); break;
+			case '\\': out.append("\\\\", 2); break;
+			case '\b': out.append("\\b", 2); break;
+			case '\f': out.append("\\f", 2); break;
+			case '\n': out.append("\\n", 2); break;
+			case '\r': out.append("\\r", 2); break;
+			case '\t': out.append("\\t", 2); break;
+			default: {
+				char u[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+				out.append(u, 6);
+			}
+		}
+	}
+	out.append(str + start, len - start);
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2016-2018 Julien Chavanton <jchavanton@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA~
+ */
+
+#ifndef VOIP_PATROL_JSON_H
+#define VOIP_PATROL_JSON_H
+
+#include <string>
+#include <cstdint>
+
+/*
+ * Append-only JSON writer, the buffer is kept between documents so
+ * that a writer reused with clear() does not allocate once warmed up.
+ */
+class JsonWriter {
+	public:
+		JsonWriter(size_t reserve=2048);
+		void clear();
+		const std::string & str() const { return buffer; }
+		void begin_object();
+		void begin_object(const char *key);
+		void end_object();
+		void begin_array(const char *key);
+		void end_array();
+		// array elements
+		void add_value(long long value);
+		void add_value(double value);
+		void add(const char *key, const std::string &value);
+		void add(const char *key, const char *value);
+		void add(const char *key, int value);
+		void add(const char *key, unsigned value);
+		void add(const char *key, long value);
+		void add(const char *key, unsigned long value);
+		void add(const char *key, long long value);
+		void add(const char *key, unsigned long long value);
+		void add(const char *key, double value);
+		void add(const char *key, bool value);
+		void add_raw(const char *key, const std::string &json);
+		static void escape(std::string &out, const char *str, size_t len);
+	private:
+		void separator();
+		void key(const char *key);
+		void add_int(const char *key, long long value);
+		void add_uint(const char *key, unsigned long long value);
+		void append_double(double value);
+		std::string buffer;
+		uint64_t not_first;   // one bit per nesting level, set once a member was written
+		int depth;
+};
+
+#endif
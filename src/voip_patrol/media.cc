@@ -0,0 +1,731 @@
+/*
+ * Copyright (C) 2016-2018 Julien Chavanton <jchavanton@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA~
+ */
+
+#include "media.hh"
+#include "log.h"
+#include <fstream>
+#include <iterator>
+#include <cstring>
+#include <cmath>
+#include <cstdlib>
+#include <cctype>
+#include <ctime>
+#include <strings.h>
+
+#define SIGNATURE PJMEDIA_SIG_CLASS_APP('V', 'P')
+#define VP_PI 3.14159265358979323846
+#define VP_SYNTH_LEVEL 0.3  // generated audio peak, about -10 dBFS
+
+static inline unsigned read_u16(const unsigned char *p) {
+	return p[0] | (p[1] << 8);
+}
+
+static inline unsigned read_u32(const unsigned char *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned)p[3] << 24);
+}
+
+
+std::shared_ptr<AudioClip> load_wav_clip(const std::string &file_name) {
+	std::ifstream file(file_name, std::ios::binary);
+	if (!file.is_open()) {
+		LOG(logERROR) <<__FUNCTION__<<": can not open ["<<file_name<<"]";
+		return nullptr;
+	}
+	std::vector<unsigned char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	if (data.size() < 12 || memcmp(&data[0], "RIFF", 4) != 0 || memcmp(&data[8], "WAVE", 4) != 0) {
+		LOG(logERROR) <<__FUNCTION__<<": not a WAV file ["<<file_name<<"]";
+		return nullptr;
+	}
+	unsigned format = 0, channels = 0, clock_rate = 0, bits = 0;
+	const unsigned char *pcm = nullptr;
+	size_t pcm_len = 0;
+	size_t pos = 12;
+	while (pos + 8 <= data.size()) {
+		const unsigned char *chunk = &data[pos];
+		size_t len = read_u32(chunk + 4);
+		size_t avail = data.size() - pos - 8;
+		if (len > avail)
+			len = avail;
+		if (memcmp(chunk, "fmt ", 4) == 0 && len >= 16) {
+			format = read_u16(chunk + 8);
+			channels = read_u16(chunk + 10);
+			clock_rate = read_u32(chunk + 12);
+			bits = read_u16(chunk + 22);
+			if (format == 0xFFFE && len >= 40) // WAVE_FORMAT_EXTENSIBLE, sub format follows
+				format = read_u16(chunk + 32);
+		} else if (memcmp(chunk, "data", 4) == 0) {
+			pcm = chunk + 8;
+			pcm_len = len;
+		}
+		pos += 8 + len + (len & 1);
+	}
+	if (format != 1 || bits != 16 || channels == 0 || clock_rate == 0 || !pcm) {
+		LOG(logERROR) <<__FUNCTION__<<": unsupported WAV ["<<file_name<<"] format["<<format<<"] bits["<<bits<<"] channels["<<channels<<"]";
+		return nullptr;
+	}
+	std::shared_ptr<AudioClip> clip = std::make_shared<AudioClip>();
+	clip->name = file_name;
+	clip->clock_rate = clock_rate;
+	size_t frame_size = 2 * channels;
+	size_t count = pcm_len / frame_size;
+	clip->samples.resize(count);
+	// only the first channel is played
+	for (size_t i = 0; i < count; i++)
+		clip->samples[i] = (pj_int16_t)read_u16(pcm + i * frame_size);
+	return clip;
+}
+
+// windowed sinc interpolation, done once per clip and clock rate
+std::shared_ptr<AudioClip> resample_clip(const AudioClip &in, unsigned clock_rate) {
+	const int half_width = 16;
+	std::shared_ptr<AudioClip> out = std::make_shared<AudioClip>();
+	out->name = in.name;
+	out->clock_rate = clock_rate;
+	double step = (double)in.clock_rate / clock_rate;
+	// the cut off follows the lowest of the two Nyquist frequencies
+	double cutoff = step > 1.0 ? 1.0 / step : 1.0;
+	double width = half_width / cutoff;
+	size_t count = (size_t)(in.samples.size() / step);
+	out->samples.resize(count);
+	for (size_t i = 0; i < count; i++) {
+		double t = i * step;
+		long first = (long)std::ceil(t - width);
+		long last = (long)std::floor(t + width);
+		double sum = 0.0;
+		for (long k = first; k <= last; k++) {
+			if (k < 0 || k >= (long)in.samples.size())
+				continue;
+			double x = k - t;
+			double sinc = x == 0.0 ? 1.0 : std::sin(VP_PI * x * cutoff) / (VP_PI * x * cutoff);
+			double window = 0.5 + 0.5 * std::cos(VP_PI * x / width);
+			sum += in.samples[k] * sinc * window * cutoff;
+		}
+		if (sum > 32767.0) sum = 32767.0;
+		if (sum < -32768.0) sum = -32768.0;
+		out->samples[i] = (pj_int16_t)std::lround(sum);
+	}
+	return out;
+}
+
+static inline void write_u16(unsigned char *p, unsigned v) {
+	p[0] = v & 0xFF;
+	p[1] = (v >> 8) & 0xFF;
+}
+
+static inline void write_u32(unsigned char *p, unsigned v) {
+	write_u16(p, v & 0xFFFF);
+	write_u16(p + 2, v >> 16);
+}
+
+bool write_wav_clip(const AudioClip &clip, const std::string &file_name) {
+	std::ofstream file(file_name, std::ios::binary);
+	if (!file.is_open()) {
+		LOG(logERROR) <<__FUNCTION__<<": can not open ["<<file_name<<"]";
+		return false;
+	}
+	unsigned data_len = clip.samples.size() * sizeof(pj_int16_t);
+	unsigned char header[44];
+	memcpy(header, "RIFF", 4);
+	write_u32(header + 4, 36 + data_len);
+	memcpy(header + 8, "WAVEfmt ", 8);
+	write_u32(header + 16, 16);
+	write_u16(header + 20, 1); // PCM
+	write_u16(header + 22, 1);
+	write_u32(header + 24, clip.clock_rate);
+	write_u32(header + 28, clip.clock_rate * 2);
+	write_u16(header + 32, 2);
+	write_u16(header + 34, 16);
+	memcpy(header + 36, "data", 4);
+	write_u32(header + 40, data_len);
+	file.write((const char *)header, sizeof(header));
+	std::vector<unsigned char> pcm(data_len);
+	for (size_t i = 0; i < clip.samples.size(); i++)
+		write_u16(&pcm[i * 2], (pj_uint16_t)clip.samples[i]);
+	if (data_len)
+		file.write((const char *)&pcm[0], data_len);
+	if (!file.good()) {
+		LOG(logERROR) <<__FUNCTION__<<": can not write ["<<file_name<<"]";
+		return false;
+	}
+	return true;
+}
+
+
+static const float dtmf_rows[4] = {697.0f, 770.0f, 852.0f, 941.0f};
+static const float dtmf_cols[4] = {1209.0f, 1336.0f, 1477.0f, 1633.0f};
+static const char dtmf_keys[] = "123A456B789C*0#D";
+
+static void add_sine(std::vector<pj_int16_t> &out, size_t start, size_t count, double freq, unsigned clock_rate, double level) {
+	for (size_t i = 0; i < count; i++) {
+		double v = out[start + i] + level * 32767.0 * std::sin(2.0 * VP_PI * freq * i / clock_rate);
+		out[start + i] = (pj_int16_t)std::lround(v);
+	}
+}
+
+bool is_synthetic_clip(const std::string &name) {
+	return name == "noise" || name == "silence" || name.compare(0, 5, "tone:") == 0
+	       || name.compare(0, 6, "sweep:") == 0 || name.compare(0, 5, "dtmf:") == 0;
+}
+
+std::shared_ptr<AudioClip> synthesize_clip(const std::string &name, unsigned clock_rate) {
+	if (!is_synthetic_clip(name))
+		return nullptr;
+	std::shared_ptr<AudioClip> clip = std::make_shared<AudioClip>();
+	clip->name = name;
+	clip->clock_rate = clock_rate;
+	std::vector<pj_int16_t> &samples = clip->samples;
+	std::string args = name.substr(name.find(':') + 1);
+	if (name == "silence") {
+		samples.assign(clock_rate / 50, 0);
+	} else if (name == "noise") {
+		// a second of white noise, xorshift so that every run plays the same
+		samples.resize(clock_rate);
+		uint32_t x = 2463534242u;
+		for (auto &sample : samples) {
+			x ^= x << 13;
+			x ^= x >> 17;
+			x ^= x << 5;
+			sample = (pj_int16_t)(((int32_t)(x >> 16) - 32768) * VP_SYNTH_LEVEL);
+		}
+	} else if (name.compare(0, 5, "tone:") == 0) {
+		std::vector<double> freqs;
+		size_t pos = 0;
+		while (pos < args.size()) {
+			size_t end = args.find('+', pos);
+			if (end == std::string::npos)
+				end = args.size();
+			double freq = atof(args.substr(pos, end - pos).c_str());
+			if (freq <= 0.0 || freq * 2 >= clock_rate)
+				return nullptr;
+			freqs.push_back(freq);
+			pos = end + 1;
+		}
+		if (freqs.empty())
+			return nullptr;
+		// whole Hz frequencies complete their cycles in one second, the loop is seamless
+		samples.assign(clock_rate, 0);
+		for (double freq : freqs)
+			add_sine(samples, 0, samples.size(), freq, clock_rate, VP_SYNTH_LEVEL / freqs.size());
+	} else if (name.compare(0, 6, "sweep:") == 0) {
+		size_t dash = args.find('-');
+		double low = atof(args.substr(0, dash).c_str());
+		double high = dash == std::string::npos ? 0.0 : atof(args.substr(dash + 1).c_str());
+		if (low <= 0.0 || high <= low || high * 2 >= clock_rate)
+			return nullptr;
+		// up for two seconds, then back down, the phase is continuous
+		size_t half = clock_rate * 2;
+		samples.resize(half * 2);
+		double phase = 0.0;
+		for (size_t i = 0; i < samples.size(); i++) {
+			double t = (double)(i < half ? i : samples.size() - i) / half;
+			double freq = low + (high - low) * t;
+			samples[i] = (pj_int16_t)std::lround(VP_SYNTH_LEVEL * 32767.0 * std::sin(phase));
+			phase += 2.0 * VP_PI * freq / clock_rate;
+			if (phase > 2.0 * VP_PI)
+				phase -= 2.0 * VP_PI;
+		}
+	} else if (name.compare(0, 5, "dtmf:") == 0) {
+		// 100 ms per digit, 100 ms pause, one second of silence before it repeats
+		size_t digit_len = clock_rate / 10;
+		samples.assign(digit_len * 2 * args.size() + clock_rate, 0);
+		for (size_t d = 0; d < args.size(); d++) {
+			const char *key = strchr(dtmf_keys, toupper(args[d]));
+			if (!key || !*key)
+				return nullptr;
+			int idx = key - dtmf_keys;
+			add_sine(samples, d * digit_len * 2, digit_len, dtmf_rows[idx / 4], clock_rate, VP_SYNTH_LEVEL / 2);
+			add_sine(samples, d * digit_len * 2, digit_len, dtmf_cols[idx % 4], clock_rate, VP_SYNTH_LEVEL / 2);
+		}
+	}
+	if (samples.empty())
+		return nullptr;
+	return clip;
+}
+
+
+std::vector<std::string> parse_codec_list(const std::string &list) {
+	std::vector<std::string> codecs;
+	size_t pos = 0;
+	while (pos < list.size()) {
+		size_t end = list.find(',', pos);
+		if (end == std::string::npos)
+			end = list.size();
+		std::string codec = list.substr(pos, end - pos);
+		codec = codec.substr(0, codec.find('/'));
+		if (!codec.empty())
+			codecs.push_back(codec);
+		pos = end + 1;
+	}
+	return codecs;
+}
+
+static std::string sdp_codec_name(const pjmedia_sdp_media *m, const pj_str_t *fmt) {
+	pjmedia_sdp_attr *attr = pjmedia_sdp_media_find_attr2(m, "rtpmap", fmt);
+	pjmedia_sdp_rtpmap rtpmap;
+	if (attr && pjmedia_sdp_attr_get_rtpmap(attr, &rtpmap) == PJ_SUCCESS)
+		return std::string(rtpmap.enc_name.ptr, rtpmap.enc_name.slen);
+	// static payload types do not need an rtpmap
+	int pt = atoi(std::string(fmt->ptr, fmt->slen).c_str());
+	switch (pt) {
+		case 0: return "PCMU";
+		case 3: return "GSM";
+		case 8: return "PCMA";
+		case 9: return "G722";
+		case 18: return "G729";
+	}
+	return "";
+}
+
+bool sdp_filter_codecs(pjmedia_sdp_session *sdp, const std::vector<std::string> &codecs) {
+	bool found = false;
+	for (unsigned i = 0; i < sdp->media_count; i++) {
+		pjmedia_sdp_media *m = sdp->media[i];
+		if (pj_stricmp2(&m->desc.media, "audio") != 0)
+			continue;
+		unsigned fmt_count = m->desc.fmt_count;
+		std::vector<std::string> names(fmt_count);
+		std::vector<bool> kept(fmt_count, false);
+		for (unsigned f = 0; f < fmt_count; f++)
+			names[f] = sdp_codec_name(m, &m->desc.fmt[f]);
+		pj_str_t fmt[PJMEDIA_MAX_SDP_FMT];
+		unsigned count = 0;
+		for (const std::string &codec : codecs) {
+			for (unsigned f = 0; f < fmt_count; f++) {
+				if (!kept[f] && strcasecmp(names[f].c_str(), codec.c_str()) == 0) {
+					fmt[count++] = m->desc.fmt[f];
+					kept[f] = true;
+				}
+			}
+		}
+		if (count == 0)
+			continue;
+		found = true;
+		for (unsigned f = 0; f < fmt_count; f++) {
+			if (!kept[f] && strcasecmp(names[f].c_str(), "telephone-event") == 0) {
+				fmt[count++] = m->desc.fmt[f];
+				kept[f] = true;
+			}
+		}
+		// the attributes of the formats dropped go with them
+		for (unsigned f = 0; f < fmt_count; f++) {
+			if (kept[f])
+				continue;
+			pjmedia_sdp_attr *attr;
+			while ((attr = pjmedia_sdp_media_find_attr2(m, "rtpmap", &m->desc.fmt[f])))
+				pjmedia_sdp_attr_remove(&m->attr_count, m->attr, attr);
+			while ((attr = pjmedia_sdp_media_find_attr2(m, "fmtp", &m->desc.fmt[f])))
+				pjmedia_sdp_attr_remove(&m->attr_count, m->attr, attr);
+		}
+		for (unsigned f = 0; f < count; f++)
+			m->desc.fmt[f] = fmt[f];
+		m->desc.fmt_count = count;
+	}
+	return found;
+}
+
+
+/*
+ * PlaybackCache implementation
+ */
+
+std::shared_ptr<const AudioClip> PlaybackCache::load(const std::string &name) {
+	auto it = clips.find(name);
+	if (it != clips.end())
+		return it->second;
+	std::shared_ptr<const AudioClip> clip = load_wav_clip(name);
+	if (clip && clip->samples.empty())
+		clip = nullptr;
+	// a file that can not be loaded is not read again
+	clips[name] = clip;
+	if (!clip)
+		return nullptr;
+	LOG(logINFO) <<__FUNCTION__<<": loaded ["<<name<<"] rate["<<clip->clock_rate<<"] samples["<<clip->samples.size()<<"]";
+	return clip;
+}
+
+std::shared_ptr<const AudioClip> PlaybackCache::generate(const std::string &name, unsigned clock_rate) {
+	std::string key = name + "@" + std::to_string(clock_rate);
+	auto it = clips.find(key);
+	if (it != clips.end())
+		return it->second;
+	std::shared_ptr<const AudioClip> clip = synthesize_clip(name, clock_rate);
+	clips[key] = clip;
+	if (!clip) {
+		LOG(logERROR) <<__FUNCTION__<<": invalid ["<<name<<"] at "<<clock_rate<<"Hz";
+		return nullptr;
+	}
+	LOG(logINFO) <<__FUNCTION__<<": generated ["<<name<<"] rate["<<clock_rate<<"] samples["<<clip->samples.size()<<"]";
+	return clip;
+}
+
+std::shared_ptr<const AudioClip> PlaybackCache::get(const std::string &name, unsigned clock_rate) {
+	std::lock_guard<std::mutex> guard(lock);
+	if (is_synthetic_clip(name))
+		return generate(name, clock_rate ? clock_rate : PJSUA_DEFAULT_CLOCK_RATE);
+	std::shared_ptr<const AudioClip> clip = load(name);
+	if (!clip || clock_rate == 0 || clock_rate == clip->clock_rate)
+		return clip;
+	std::string key = name + "@" + std::to_string(clock_rate);
+	auto it = clips.find(key);
+	if (it != clips.end())
+		return it->second;
+	std::shared_ptr<const AudioClip> resampled = resample_clip(*clip, clock_rate);
+	clips[key] = resampled;
+	LOG(logINFO) <<__FUNCTION__<<": resampled ["<<name<<"] rate["<<clip->clock_rate<<"->"<<clock_rate<<"]";
+	return resampled;
+}
+
+
+/*
+ * PlaybackPort implementation
+ */
+
+PlaybackPort::PlaybackPort(std::shared_ptr<const AudioClip> p_clip, unsigned samples_per_frame) : clip(p_clip) {
+	pj_bzero(&port, sizeof(port));
+	pj_str_t name = pj_str((char *)"vp_play");
+	if (!samples_per_frame)
+		samples_per_frame = clip->clock_rate * VP_MEDIA_PTIME / 1000;
+	pjmedia_port_info_init(&port.info, &name, SIGNATURE, clip->clock_rate, 1, 16, samples_per_frame);
+	port.port_data.pdata = this;
+	port.get_frame = &get_frame;
+}
+
+PlaybackPort::~PlaybackPort() {
+	if (slot != PJSUA_INVALID_ID)
+		pjsua_conf_remove_port(slot);
+	if (pool)
+		pj_pool_release(pool);
+}
+
+pj_status_t PlaybackPort::connect(pjsua_conf_port_id sink) {
+	pj_status_t status;
+	if (slot == PJSUA_INVALID_ID) {
+		pool = pjsua_pool_create("vp_play", 512, 512);
+		if (!pool)
+			return PJ_ENOMEM;
+		status = pjsua_conf_add_port(pool, &port, &slot);
+		if (status != PJ_SUCCESS) {
+			slot = PJSUA_INVALID_ID;
+			return status;
+		}
+	}
+	return pjsua_conf_connect(slot, sink);
+}
+
+pj_status_t PlaybackPort::get_frame(pjmedia_port *this_port, pjmedia_frame *frame) {
+	PlaybackPort *player = (PlaybackPort *)this_port->port_data.pdata;
+	const std::vector<pj_int16_t> &samples = player->clip->samples;
+	unsigned count = PJMEDIA_PIA_SPF(&this_port->info);
+	pj_int16_t *out = (pj_int16_t *)frame->buf;
+	// the clip is played in a loop, like pjsua_player
+	while (count) {
+		size_t n = samples.size() - player->cursor;
+		if (n > count)
+			n = count;
+		memcpy(out, &samples[player->cursor], n * sizeof(pj_int16_t));
+		out += n;
+		count -= n;
+		player->cursor += n;
+		if (player->cursor == samples.size())
+			player->cursor = 0;
+	}
+	frame->type = PJMEDIA_FRAME_TYPE_AUDIO;
+	frame->size = PJMEDIA_PIA_SPF(&this_port->info) * sizeof(pj_int16_t);
+	return PJ_SUCCESS;
+}
+
+
+/*
+ * CaptureSink implementation
+ */
+
+CaptureSink::CaptureSink(unsigned clock_rate, unsigned samples_per_frame, unsigned max_seconds) {
+	pj_bzero(&port, sizeof(port));
+	pj_str_t name = pj_str((char *)"vp_capture");
+	pjmedia_port_info_init(&port.info, &name, SIGNATURE, clock_rate, 1, 16, samples_per_frame);
+	port.port_data.pdata = this;
+	port.put_frame = &put_frame;
+	capacity = (size_t)clock_rate * max_seconds;
+}
+
+CaptureSink::~CaptureSink() {
+	if (slot != PJSUA_INVALID_ID)
+		pjsua_conf_remove_port(slot);
+	if (pool)
+		pj_pool_release(pool);
+}
+
+pj_status_t CaptureSink::connect(pjsua_conf_port_id source) {
+	pj_status_t status;
+	if (slot == PJSUA_INVALID_ID) {
+		pool = pjsua_pool_create("vp_capture", 512, 512);
+		if (!pool)
+			return PJ_ENOMEM;
+		status = pjsua_conf_add_port(pool, &port, &slot);
+		if (status != PJ_SUCCESS) {
+			slot = PJSUA_INVALID_ID;
+			return status;
+		}
+	}
+	return pjsua_conf_connect(source, slot);
+}
+
+pj_status_t CaptureSink::put_frame(pjmedia_port *this_port, pjmedia_frame *frame) {
+	CaptureSink *capture = (CaptureSink *)this_port->port_data.pdata;
+	if (frame->type != PJMEDIA_FRAME_TYPE_AUDIO)
+		return PJ_SUCCESS;
+	const pj_int16_t *in = (const pj_int16_t *)frame->buf;
+	size_t count = frame->size / sizeof(pj_int16_t);
+	std::lock_guard<std::mutex> guard(capture->lock);
+	if (capture->detector)
+		capture->detector->process(in, count);
+	if (capture->capacity == 0)
+		return PJ_SUCCESS;
+	std::vector<pj_int16_t> &ring = capture->ring;
+	// the buffer only grows as long as the call lasts
+	if (ring.size() < capture->capacity) {
+		size_t n = capture->capacity - ring.size();
+		if (n > count)
+			n = count;
+		ring.insert(ring.end(), in, in + n);
+		in += n;
+		count -= n;
+	}
+	while (count) {
+		size_t n = ring.size() - capture->head;
+		if (n > count)
+			n = count;
+		memcpy(&ring[capture->head], in, n * sizeof(pj_int16_t));
+		in += n;
+		count -= n;
+		capture->head += n;
+		if (capture->head == ring.size())
+			capture->head = 0;
+	}
+	return PJ_SUCCESS;
+}
+
+ToneReport CaptureSink::detection() {
+	std::lock_guard<std::mutex> guard(lock);
+	if (!detector)
+		return ToneReport();
+	return detector->report();
+}
+
+std::shared_ptr<AudioClip> CaptureSink::take() {
+	std::shared_ptr<AudioClip> clip = std::make_shared<AudioClip>();
+	clip->name = "capture";
+	clip->clock_rate = PJMEDIA_PIA_SRATE(&port.info);
+	std::lock_guard<std::mutex> guard(lock);
+	clip->samples.reserve(ring.size());
+	clip->samples.insert(clip->samples.end(), ring.begin() + head, ring.end());
+	clip->samples.insert(clip->samples.end(), ring.begin(), ring.begin() + head);
+	ring.clear();
+	head = 0;
+	return clip;
+}
+
+
+/*
+ * MediaLink implementation
+ */
+
+MediaLink::MediaLink(pjmedia_port *stream) : stream(stream) {
+}
+
+bool MediaLink::init() {
+	unsigned clock_rate = PJMEDIA_PIA_SRATE(&stream->info);
+	unsigned samples_per_frame = PJMEDIA_PIA_SPF(&stream->info);
+	pool = pjsua_pool_create("vp_link", 512, 512);
+	if (!pool)
+		return false;
+	if (pjmedia_null_port_create(pool, clock_rate, 1, samples_per_frame, 16, &null_port) != PJ_SUCCESS) {
+		null_port = nullptr;
+		return false;
+	}
+	ptime_ticks = PJMEDIA_PIA_PTIME(&stream->info) / VP_MEDIA_TICK;
+	if (ptime_ticks == 0)
+		ptime_ticks = 1;
+	buffer.resize(samples_per_frame);
+	return true;
+}
+
+MediaLink::~MediaLink() {
+	delete source;
+	if (null_port)
+		pjmedia_port_destroy(null_port);
+	if (pool)
+		pj_pool_release(pool);
+}
+
+
+/*
+ * MediaPump implementation
+ */
+
+MediaPump::~MediaPump() {
+	stop();
+}
+
+bool MediaPump::start(unsigned threads) {
+	if (!workers.empty())
+		return true;
+	pool = pjsua_pool_create("vp_pump", 512, 512);
+	if (!pool)
+		return false;
+	for (unsigned i = 0; i < threads; i++) {
+		Worker *worker = new Worker();
+		worker->pump = this;
+		worker->index = i;
+		// one tick every VP_MEDIA_TICK ms, each link moves a frame every ptime
+		pj_status_t status = pjmedia_clock_create(pool, 8000, 1, 8 * VP_MEDIA_TICK, PJMEDIA_CLOCK_NO_HIGHEST_PRIO,
+		                                          &MediaPump::on_clock, worker, &worker->clock);
+		if (status == PJ_SUCCESS)
+			status = pjmedia_clock_start(worker->clock);
+		if (status != PJ_SUCCESS) {
+			LOG(logERROR) <<__FUNCTION__<<": can not start media clock["<<i<<"] status["<<status<<"]";
+			if (worker->clock)
+				pjmedia_clock_destroy(worker->clock);
+			delete worker;
+			break;
+		}
+		workers.push_back(worker);
+	}
+	start_time = std::chrono::steady_clock::now();
+	LOG(logINFO) <<__FUNCTION__<<": media pump threads["<<workers.size()<<"]";
+	return !workers.empty();
+}
+
+void MediaPump::stop() {
+	for (auto worker : workers) {
+		pjmedia_clock_destroy(worker->clock);
+		// links of calls still up are deleted when their call releases them
+		for (auto link : worker->links)
+			link->worker = -1;
+		delete worker;
+	}
+	workers.clear();
+	if (pool) {
+		pj_pool_release(pool);
+		pool = nullptr;
+	}
+}
+
+void MediaPump::add(MediaLink *link) {
+	if (workers.empty())
+		return;
+	int idx = next++ % workers.size();
+	Worker *worker = workers[idx];
+	std::lock_guard<std::mutex> guard(worker->lock);
+	link->worker = idx;
+	worker->links.push_back(link);
+}
+
+void MediaPump::release(MediaLink *link) {
+	if (link->worker >= 0) {
+		Worker *worker = workers[link->worker];
+		// the clock thread moves the frames under this lock, it no longer sees the link after it
+		std::lock_guard<std::mutex> guard(worker->lock);
+		for (auto it = worker->links.begin(); it != worker->links.end(); ++it) {
+			if (*it == link) {
+				*it = worker->links.back();
+				worker->links.pop_back();
+				break;
+			}
+		}
+	}
+	link->sink = nullptr;
+	delete link;
+}
+
+static inline pj_uint64_t thread_cpu_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (pj_uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void MediaPump::report(Worker *worker) {
+	unsigned long frames = worker->frames.load(std::memory_order_relaxed);
+	pj_uint64_t busy_ns = worker->busy_ns.load(std::memory_order_relaxed);
+	double seconds = VP_MEDIA_STATS_MS / 1000.0;
+	LOG(logINFO) <<__FUNCTION__<<": [media] pump["<<worker->index<<"] links["<<worker->links.size()<<"] frames/s["
+	             <<(frames - worker->window_frames) / seconds<<"] busy["<<(busy_ns - worker->window_busy_ns) / (seconds * 1e7)<<"%]";
+	worker->window_frames = frames;
+	worker->window_busy_ns = busy_ns;
+}
+
+void MediaPump::log_stats() {
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+	if (seconds <= 0.0)
+		return;
+	for (auto worker : workers) {
+		unsigned long frames = worker->frames.load(std::memory_order_relaxed);
+		pj_uint64_t busy_ns = worker->busy_ns.load(std::memory_order_relaxed);
+		LOG(logINFO) <<__FUNCTION__<<": [media] pump["<<worker->index<<"] frames["<<frames<<"] frames/s["<<frames / seconds
+		             <<"] busy["<<busy_ns / (seconds * 1e7)<<"%] ns/frame["<<(frames ? busy_ns / frames : 0)<<"]";
+	}
+}
+
+void MediaPump::on_clock(const pj_timestamp *ts, void *user_data) {
+	PJ_UNUSED_ARG(ts);
+	Worker *worker = (Worker *)user_data;
+	pj_uint64_t start_ns = thread_cpu_ns();
+	std::lock_guard<std::mutex> guard(worker->lock);
+	unsigned long frames = 0;
+	for (auto link : worker->links) {
+		if (++link->ticks < link->ptime_ticks)
+			continue;
+		link->ticks = 0;
+		pj_size_t size = link->buffer.size() * sizeof(pj_int16_t);
+		pjmedia_frame frame;
+		pj_bzero(&frame, sizeof(frame));
+		frame.buf = &link->buffer[0];
+		frame.size = size;
+		frame.type = PJMEDIA_FRAME_TYPE_AUDIO;
+		frame.timestamp.u64 = link->timestamp;
+		if (link->source)
+			pjmedia_port_get_frame(link->source->get_port(), &frame);
+		else
+			pj_bzero(frame.buf, size);
+		pjmedia_port_put_frame(link->stream, &frame);
+
+		frame.size = size;
+		frame.type = PJMEDIA_FRAME_TYPE_AUDIO;
+		pjmedia_port_get_frame(link->stream, &frame);
+		if (link->sink) {
+			// nothing decoded, the sink gets silence like a bridge listener would
+			if (frame.type != PJMEDIA_FRAME_TYPE_AUDIO) {
+				pj_bzero(frame.buf, size);
+				frame.type = PJMEDIA_FRAME_TYPE_AUDIO;
+			}
+			frame.size = size;
+			pjmedia_port_put_frame(link->sink, &frame);
+		}
+		link->timestamp += link->buffer.size();
+		frames++;
+	}
+	if (frames) {
+		worker->pump->frames.fetch_add(frames, std::memory_order_relaxed);
+		worker->frames.store(worker->frames.load(std::memory_order_relaxed) + frames, std::memory_order_relaxed);
+	}
+	worker->busy_ns.store(worker->busy_ns.load(std::memory_order_relaxed) + thread_cpu_ns() - start_ns, std::memory_order_relaxed);
+	if (++worker->ticks == VP_MEDIA_STATS_MS / VP_MEDIA_TICK) {
+		worker->ticks = 0;
+		worker->pump->report(worker);
+	}
+}
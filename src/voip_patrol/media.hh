@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2016-2018 Julien Chavanton <jchavanton@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA~
+ */
+
+#ifndef VOIP_PATROL_MEDIA_H
+#define VOIP_PATROL_MEDIA_H
+
+#include <pjsua-lib/pjsua.h>
+#include "tone.hh"
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <atomic>
+#include <chrono>
+
+#define VP_MEDIA_PTIME 20
+#define VP_MEDIA_TICK 10 // ms, media pump clock resolution
+#define VP_MEDIA_STATS_MS 10000 // media pump threads report their load this often
+
+/* mono 16 bit PCM, shared read-only by every call playing it */
+struct AudioClip {
+	std::string name;
+	unsigned clock_rate {0};
+	std::vector<pj_int16_t> samples;
+};
+
+// 16 bit PCM WAV file, only the first channel is kept
+std::shared_ptr<AudioClip> load_wav_clip(const std::string &file_name);
+std::shared_ptr<AudioClip> resample_clip(const AudioClip &in, unsigned clock_rate);
+bool write_wav_clip(const AudioClip &clip, const std::string &file_name);
+
+/*
+ * Generated audio, played like a file without reading anything:
+ * "tone:1000" or "tone:350+440", "sweep:300-3400", "dtmf:123#", "noise", "silence".
+ * synthesize_clip returns nullptr for any other name or invalid parameters.
+ */
+bool is_synthetic_clip(const std::string &name);
+std::shared_ptr<AudioClip> synthesize_clip(const std::string &name, unsigned clock_rate);
+
+// "PCMU,PCMA,opus", the encoding names as found in the rtpmap, a "/rate" suffix is ignored
+std::vector<std::string> parse_codec_list(const std::string &list);
+
+/*
+ * Codec selection. In an SDP the audio formats are reduced to the listed
+ * codecs in the list order, telephone-event is kept and a media without
+ * any of them is left as it is.
+ */
+bool sdp_filter_codecs(pjmedia_sdp_session *sdp, const std::vector<std::string> &codecs);
+
+/*
+ * Every distinct playback file is decoded once and kept in memory,
+ * calls only hold a reference to the clip and their own position in it.
+ */
+class PlaybackCache {
+	public:
+		// clock_rate 0: as found in the file, otherwise resampled once and kept as well,
+		// generated clips are made at the rate asked for, PJSUA_DEFAULT_CLOCK_RATE with 0
+		std::shared_ptr<const AudioClip> get(const std::string &name, unsigned clock_rate=0);
+	private:
+		std::shared_ptr<const AudioClip> load(const std::string &name);
+		std::shared_ptr<const AudioClip> generate(const std::string &name, unsigned clock_rate);
+		std::mutex lock;
+		std::unordered_map<std::string, std::shared_ptr<const AudioClip>> clips;
+};
+
+/* per call source port reading a shared clip in a loop */
+class PlaybackPort {
+	public:
+		PlaybackPort(std::shared_ptr<const AudioClip> clip, unsigned samples_per_frame=0);
+		~PlaybackPort();
+		pjmedia_port * get_port() { return &port; }
+		pj_status_t connect(pjsua_conf_port_id sink);
+	private:
+		static pj_status_t get_frame(pjmedia_port *port, pjmedia_frame *frame);
+		pjmedia_port port;
+		std::shared_ptr<const AudioClip> clip;
+		size_t cursor {0};
+		pj_pool_t *pool {nullptr};
+		pjsua_conf_port_id slot {PJSUA_INVALID_ID};
+};
+
+/*
+ * Per call sink keeping the received audio in memory in place of a WAV
+ * recorder, the analysis reads it from there once the call is disconnected.
+ * Past max_seconds the oldest audio is overwritten, with 0 nothing is kept
+ * and the audio only goes through the detector.
+ */
+class CaptureSink {
+	public:
+		CaptureSink(unsigned clock_rate, unsigned samples_per_frame, unsigned max_seconds);
+		~CaptureSink();
+		pjmedia_port * get_port() { return &port; }
+		// bridge mode, the sink listens to the call conference port
+		pj_status_t connect(pjsua_conf_port_id source);
+		// the audio captured so far, oldest sample first
+		std::shared_ptr<AudioClip> take();
+		ToneReport detection();
+		// set before the sink is connected
+		std::unique_ptr<ToneDetector> detector;
+	private:
+		static pj_status_t put_frame(pjmedia_port *port, pjmedia_frame *frame);
+		pjmedia_port port;
+		std::mutex lock;
+		std::vector<pj_int16_t> ring; // grows up to capacity, then wraps at head
+		size_t capacity;
+		size_t head {0};
+		pj_pool_t *pool {nullptr};
+		pjsua_conf_port_id slot {PJSUA_INVALID_ID};
+};
+
+/*
+ * Call stream wired straight to its own source and sink, the media pump
+ * drives it instead of the conference bridge which only gets a null port.
+ */
+class MediaLink {
+	public:
+		MediaLink(pjmedia_port *stream);
+		~MediaLink();
+		bool init();
+		pjmedia_port *stream;              // encodes on put_frame, decodes on get_frame
+		pjmedia_port *null_port {nullptr}; // registered in the bridge in place of the stream
+		PlaybackPort *source {nullptr};    // nullptr: silence is sent
+		pjmedia_port *sink {nullptr};      // not owned, nullptr: received audio is dropped
+		pj_pool_t *pool {nullptr};
+	private:
+		friend class MediaPump;
+		unsigned ptime_ticks {1};
+		unsigned ticks {0};
+		int worker {-1};
+		pj_uint64_t timestamp {0};
+		std::vector<pj_int16_t> buffer;
+};
+
+/* clock threads moving the frames of every media link */
+class MediaPump {
+	public:
+		~MediaPump();
+		bool start(unsigned threads);
+		void stop();
+		bool is_running() { return !workers.empty(); }
+		void add(MediaLink *link);
+		// the link is deleted when this returns, called once pjsua destroyed the stream
+		// and removed the null port from the bridge, like a PlaybackPort is deleted
+		// once its port is removed
+		void release(MediaLink *link);
+		// frames moved and CPU used by every thread since the start
+		void log_stats();
+		std::atomic<unsigned long> frames {0};
+	private:
+		struct Worker {
+			MediaPump *pump;
+			unsigned index {0};
+			pjmedia_clock *clock {nullptr};
+			std::mutex lock;
+			std::vector<MediaLink *> links;
+			// only updated by the clock thread
+			unsigned ticks {0};
+			std::atomic<unsigned long> frames {0};
+			std::atomic<pj_uint64_t> busy_ns {0};
+			unsigned long window_frames {0};
+			pj_uint64_t window_busy_ns {0};
+		};
+		void report(Worker *worker);
+		std::chrono::steady_clock::time_point start_time;
+		static void on_clock(const pj_timestamp *ts, void *user_data);
+		std::vector<Worker *> workers;
+		pj_pool_t *pool {nullptr};
+		std::atomic<unsigned> next {0};
+};
+
+#endif
@@ -0,0 +1,309 @@
+/*
+ * Copyright (C) 2016-2018 Julien Chavanton <jchavanton@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA~
+ */
+
+#include "mos.hh"
+#include "dsp.hh"
+#include "log.h"
+#include <cmath>
+#include <chrono>
+#include <iostream>
+
+#define MOS_SKIP (MOS_CLOCK_RATE / 5)   // the first 200 ms of a recording are not scored
+#define MOS_ACTIVE_DB 35.0f             // frames within this range of the loudest one are scored
+#define MOS_DEAD_ZONE_DB 3.0f           // loudness differences not perceived
+#define MOS_FLOOR_DB 45.0f              // band loudness under the loudest frame that is not heard
+#define MOS_MISSING_WEIGHT 0.7f         // missing energy is less annoying than added energy
+
+static void band_loudness(const std::vector<float> &signal, size_t offset, size_t frames, std::vector<float> &db) {
+	dsp_filterbank fb;
+	dsp_filterbank_init(&fb, MOS_CLOCK_RATE, 150.0f, 3600.0f);
+	std::vector<float> energy(frames * DSP_BANDS);
+	dsp_filterbank_energy(&fb, &signal[offset], frames * MOS_HOP, MOS_HOP, &energy[0]);
+	db.resize(energy.size());
+	dsp_to_db(&energy[0], &db[0], energy.size(), 1e-10f);
+}
+
+// loudness of every frame, all bands together, mean removed
+static void envelope(const std::vector<float> &band_db, size_t frames, std::vector<float> &env) {
+	env.resize(frames);
+	float mean = 0.0f;
+	for (size_t f = 0; f < frames; f++) {
+		float sum = 0.0f;
+		for (int b = 0; b < DSP_BANDS; b++)
+			sum += std::pow(10.0f, band_db[f * DSP_BANDS + b] / 10.0f);
+		env[f] = 10.0f * std::log10(sum + 1e-10f);
+		mean += env[f];
+	}
+	mean /= frames;
+	for (size_t f = 0; f < frames; f++)
+		env[f] -= mean;
+}
+
+static float mos_mapping(float disturbance) {
+	// logistic curve, 4.5 when nothing is disturbed, 2.75 at 10 dB
+	const float slope = 0.3f;
+	const float center = 10.0f;
+	float s = 1.0f / (1.0f + std::exp(slope * (disturbance - center)));
+	float s0 = 1.0f / (1.0f + std::exp(-slope * center));
+	return 1.0f + 3.5f * s / s0;
+}
+
+MosScore mos_score(const AudioClip &reference, const AudioClip &degraded) {
+	MosScore score;
+	if (reference.clock_rate != MOS_CLOCK_RATE || degraded.clock_rate != MOS_CLOCK_RATE) {
+		score.error = "clock rate";
+		return score;
+	}
+	size_t n = reference.samples.size();
+	size_t k = degraded.samples.size();
+	if (n < MOS_CLOCK_RATE || k < MOS_SKIP + MOS_CLOCK_RATE) {
+		score.error = "recording too short";
+		return score;
+	}
+	// the reference is repeated three times, the circular lags are read without modulo
+	std::vector<float> ref(3 * n);
+	dsp_int16_to_float(&reference.samples[0], &ref[0], n);
+	std::copy(ref.begin(), ref.begin() + n, ref.begin() + n);
+	std::copy(ref.begin(), ref.begin() + n, ref.begin() + 2 * n);
+	std::vector<float> deg(k);
+	dsp_int16_to_float(&degraded.samples[0], &deg[0], k);
+
+	// coarse alignment on the loudness envelopes, any position in the looping reference
+	size_t ref_frames = n / MOS_HOP;
+	size_t deg_frames = (k - MOS_SKIP) / MOS_HOP;
+	std::vector<float> ref_db, deg_db, ref_env, deg_env;
+	band_loudness(ref, 0, 2 * ref_frames, ref_db);
+	band_loudness(deg, MOS_SKIP, deg_frames, deg_db);
+	envelope(ref_db, 2 * ref_frames, ref_env);
+	envelope(deg_db, deg_frames, deg_env);
+	size_t window = deg_frames < ref_frames ? deg_frames : ref_frames;
+	std::vector<float> corr(ref_frames);
+	dsp_xcorr(&deg_env[0], &ref_env[0], window, ref_frames, &corr[0]);
+	size_t coarse = 0;
+	for (size_t lag = 1; lag < ref_frames; lag++) {
+		if (corr[lag] > corr[coarse])
+			coarse = lag;
+	}
+
+	// fine alignment on the samples, one hop around the coarse position
+	size_t len = k - MOS_SKIP < MOS_CLOCK_RATE * 2 ? k - MOS_SKIP : MOS_CLOCK_RATE * 2;
+	if (len > n - MOS_HOP)
+		len = n - MOS_HOP;
+	size_t lags = 2 * MOS_HOP + 1;
+	std::vector<float> fine(lags);
+	size_t start = n + coarse * MOS_HOP - MOS_HOP;
+	dsp_xcorr(&deg[MOS_SKIP], &ref[start], len, lags, &fine[0]);
+	size_t best = 0;
+	for (size_t lag = 1; lag < lags; lag++) {
+		if (fine[lag] > fine[best])
+			best = lag;
+	}
+	size_t offset = (start + best) % n;
+	score.delay_ms = ((offset + n - MOS_SKIP) % n) * 1000.0f / MOS_CLOCK_RATE;
+
+	// reference aligned on the recording, band loudness of both
+	size_t frames = deg_frames;
+	std::vector<float> aligned(frames * MOS_HOP);
+	for (size_t i = 0; i < aligned.size(); i++)
+		aligned[i] = ref[(offset + i) % n];
+	band_loudness(aligned, 0, frames, ref_db);
+	band_loudness(deg, MOS_SKIP, frames, deg_db);
+
+	// frames with speech in the reference or in the recording
+	std::vector<float> ref_frame(frames), deg_frame(frames);
+	float ref_max = -200.0f, deg_max = -200.0f;
+	for (size_t f = 0; f < frames; f++) {
+		float rs = 0.0f, ds = 0.0f;
+		for (int b = 0; b < DSP_BANDS; b++) {
+			rs += std::pow(10.0f, ref_db[f * DSP_BANDS + b] / 10.0f);
+			ds += std::pow(10.0f, deg_db[f * DSP_BANDS + b] / 10.0f);
+		}
+		ref_frame[f] = 10.0f * std::log10(rs + 1e-10f);
+		deg_frame[f] = 10.0f * std::log10(ds + 1e-10f);
+		if (ref_frame[f] > ref_max) ref_max = ref_frame[f];
+		if (deg_frame[f] > deg_max) deg_max = deg_frame[f];
+	}
+	std::vector<size_t> active;
+	float gain = 0.0f;
+	size_t gain_count = 0;
+	for (size_t f = 0; f < frames; f++) {
+		bool ref_active = ref_frame[f] > ref_max - MOS_ACTIVE_DB;
+		if (ref_active) {
+			gain += deg_frame[f] - ref_frame[f];
+			gain_count++;
+		}
+		if (ref_active || deg_frame[f] > deg_max - MOS_ACTIVE_DB)
+			active.push_back(f);
+	}
+	if (!gain_count || active.size() < 2) {
+		score.error = "silent reference";
+		return score;
+	}
+	gain /= gain_count;
+	score.valid = true;
+	if (gain < -40.0f || deg_max < -90.0f) {
+		// nothing was received
+		score.mos = 1.0f;
+		score.error = "silent recording";
+		return score;
+	}
+
+	// disturbance: band loudness difference once the level is compensated,
+	// under the floor the differences are not heard
+	float floor = ref_max - MOS_FLOOR_DB;
+	float total = 0.0f;
+	std::vector<float> ref_band(active.size()), deg_band(active.size());
+	float correlation = 0.0f;
+	for (size_t i = 0; i < active.size(); i++) {
+		size_t f = active[i];
+		float sum = 0.0f;
+		for (int b = 0; b < DSP_BANDS; b++) {
+			float r = ref_db[f * DSP_BANDS + b];
+			float g = deg_db[f * DSP_BANDS + b] - gain;
+			float d = (g > floor ? g : floor) - (r > floor ? r : floor);
+			float a = std::fabs(d) - MOS_DEAD_ZONE_DB;
+			if (a < 0.0f)
+				a = 0.0f;
+			if (a > 40.0f)
+				a = 40.0f;
+			if (d < 0.0f)
+				a *= MOS_MISSING_WEIGHT;
+			sum += a * a;
+		}
+		// L4 norm over time, short loud disturbances weigh more than with an average
+		float frame = sum / DSP_BANDS;
+		total += frame * frame;
+	}
+	score.disturbance = std::sqrt(std::sqrt(total / active.size()));
+	for (int b = 0; b < DSP_BANDS; b++) {
+		for (size_t i = 0; i < active.size(); i++) {
+			ref_band[i] = ref_db[active[i] * DSP_BANDS + b];
+			deg_band[i] = deg_db[active[i] * DSP_BANDS + b];
+		}
+		correlation += dsp_pearson(&ref_band[0], &deg_band[0], active.size());
+	}
+	score.correlation = correlation / DSP_BANDS;
+	float mos = mos_mapping(score.disturbance);
+	mos = 1.0f + (mos - 1.0f) * std::sqrt(score.correlation > 0.0f ? score.correlation : 0.0f);
+	if (mos > 4.5f) mos = 4.5f;
+	if (mos < 1.0f) mos = 1.0f;
+	score.mos = mos;
+	return score;
+}
+
+int mos_benchmark(const std::string &reference_fn) {
+	std::shared_ptr<AudioClip> clip = load_wav_clip(reference_fn);
+	if (!clip) {
+		std::cerr << "can not load reference: " << reference_fn << std::endl;
+		return 1;
+	}
+	std::shared_ptr<AudioClip> reference = clip;
+	if (clip->clock_rate != MOS_CLOCK_RATE)
+		reference = resample_clip(*clip, MOS_CLOCK_RATE);
+
+	// 30 seconds call starting anywhere in the reference, lower level, noise and lost packets
+	const int call_seconds = 30;
+	const int runs = 10;
+	AudioClip clean, degraded;
+	clean.clock_rate = degraded.clock_rate = MOS_CLOCK_RATE;
+	size_t n = reference->samples.size();
+	size_t len = call_seconds * MOS_CLOCK_RATE;
+	clean.samples.resize(len);
+	degraded.samples.resize(len);
+	unsigned seed = 12345;
+	for (size_t i = 0; i < len; i++) {
+		pj_int16_t s = reference->samples[(i + 1234) % n];
+		clean.samples[i] = s;
+		seed = seed * 1103515245 + 12345;
+		int noise = (int)((seed >> 16) & 0x3ff) - 512;
+		bool lost = (i % (MOS_CLOCK_RATE / 2)) < MOS_CLOCK_RATE / 50;
+		degraded.samples[i] = lost ? 0 : (pj_int16_t)(s / 2 + noise);
+	}
+
+	MosScore score_clean = mos_score(*reference, clean);
+	MosScore score;
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < runs; i++)
+		score = mos_score(*reference, degraded);
+	auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "mos benchmark: reference[" << reference_fn << "] call[" << call_seconds << "s] runs[" << runs << "]\n"
+	          << "  clean copy   mos[" << score_clean.mos << "] delay[" << score_clean.delay_ms << "ms]\n"
+	          << "  degraded     mos[" << score.mos << "] delay[" << score.delay_ms << "ms] disturbance["
+	          << score.disturbance << "dB] correlation[" << score.correlation << "]\n"
+	          << "  cost per call second[" << elapsed / (runs * call_seconds) << "ms]" << std::endl;
+	return 0;
+}
+
+
+/*
+ * MosPool implementation
+ */
+
+MosPool::~MosPool() {
+	stop();
+}
+
+void MosPool::start(unsigned count) {
+	for (unsigned i = 0; i < count; i++)
+		threads.push_back(std::thread(&MosPool::run, this));
+	LOG(logINFO) <<__FUNCTION__<<": mos scoring threads["<<threads.size()<<"]";
+}
+
+void MosPool::stop() {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	cond.notify_all();
+	for (auto &thread : threads)
+		thread.join();
+	threads.clear();
+	// jobs submitted while stopping
+	while (!jobs.empty()) {
+		std::function<void()> job = jobs.front();
+		jobs.pop_front();
+		job();
+	}
+}
+
+void MosPool::submit(std::function<void()> job) {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (!threads.empty() && !stopping) {
+			jobs.push_back(job);
+			cond.notify_one();
+			return;
+		}
+	}
+	job();
+}
+
+void MosPool::run() {
+	std::unique_lock<std::mutex> guard(lock);
+	while (true) {
+		while (jobs.empty() && !stopping)
+			cond.wait(guard);
+		if (jobs.empty())
+			return;
+		std::function<void()> job = jobs.front();
+		jobs.pop_front();
+		guard.unlock();
+		job();
+		guard.lock();
+	}
+}
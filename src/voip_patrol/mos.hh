@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2016-2018 Julien Chavanton <jchavanton@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA~
+ */
+
+#ifndef VOIP_PATROL_MOS_H
+#define VOIP_PATROL_MOS_H
+
+#include "media.hh"
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#define MOS_CLOCK_RATE 8000
+#define MOS_HOP 128   // 16 ms frames
+
+struct MosScore {
+	bool valid {false};
+	float mos {0.0};
+	float delay_ms {0.0};      // position of the recording start in the looping reference
+	float correlation {0.0};   // mean correlation of the band loudness envelopes
+	float disturbance {0.0};   // loudness difference after alignment and gain compensation, dB
+	std::string error;
+};
+
+/*
+ * Perceptual comparison of a recording with the reference it was made from,
+ * in the spirit of PESQ: time alignment, critical band loudness, disturbance
+ * mapped to a 1 - 4.5 score. Both clips must be at MOS_CLOCK_RATE.
+ * This is an objective estimate, not an ITU-T P.862 implementation.
+ */
+MosScore mos_score(const AudioClip &reference, const AudioClip &degraded);
+
+// scores a degraded copy of the reference and prints the cost per call second
+int mos_benchmark(const std::string &reference_fn);
+
+/* worker threads scoring recordings away from the pjsip threads */
+class MosPool {
+	public:
+		~MosPool();
+		void start(unsigned threads);
+		void stop();
+		// without worker threads the job runs in the calling thread
+		void submit(std::function<void()> job);
+	private:
+		void run();
+		std::vector<std::thread> threads;
+		std::deque<std::function<void()>> jobs;
+		std::mutex lock;
+		std::condition_variable cond;
+		bool stopping {false};
+};
+
+#endif
@@ -0,0 +1,601 @@
+/*
+ * Copyright (C) 2016-2018 Julien Chavanton <jchavanton@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA~
+ */
+
+
+#include "pcap.hh"
+#include "log.h"
+#include "clock.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+#define PCAP_MAGIC 0xa1b2c3d4     // microsecond timestamps, native byte order
+#define PCAP_LINKTYPE_RAW 101      // the packets start with the IPv4 or IPv6 header
+#define PCAP_DECISION_SECONDS 60   // packets after the result of a call (BYE, last RTP) follow its decision
+
+static uint64_t now_us() {
+	return clock_wall_us();
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+	p[0] = v >> 8;
+	p[1] = v & 0xff;
+}
+
+/*
+ * IP and UDP headers, the UDP checksum is left to 0 and the IPv4 header
+ * checksum is computed, returns the header length.
+ */
+static size_t put_headers(uint8_t *p, const pj_sockaddr *src, const pj_sockaddr *dst, size_t len) {
+	bool ipv6 = dst && dst->addr.sa_family == pj_AF_INET6();
+	size_t addr_len = ipv6 ? 16 : 4;
+	size_t ip_len = ipv6 ? 40 : 20;
+	size_t udp_len = std::min(len + 8, (size_t)0xffff);
+	uint8_t *src_ip, *dst_ip;
+	memset(p, 0, ip_len + 8);
+	if (ipv6) {
+		p[0] = 0x60;
+		put16(p + 4, udp_len);
+		p[6] = 17;   // UDP
+		p[7] = 64;   // hop limit
+		src_ip = p + 8;
+		dst_ip = p + 24;
+	} else {
+		p[0] = 0x45;
+		put16(p + 2, std::min(len + 28, (size_t)0xffff));
+		p[6] = 0x40; // don't fragment
+		p[8] = 64;   // TTL
+		p[9] = 17;   // UDP
+		src_ip = p + 12;
+		dst_ip = p + 16;
+	}
+	// an address of an other family is left to 0
+	uint16_t family = ipv6 ? pj_AF_INET6() : pj_AF_INET();
+	if (src && src->addr.sa_family == family) {
+		memcpy(src_ip, pj_sockaddr_get_addr(src), addr_len);
+		put16(p + ip_len, pj_sockaddr_get_port(src));
+	}
+	if (dst && dst->addr.sa_family == family) {
+		memcpy(dst_ip, pj_sockaddr_get_addr(dst), addr_len);
+		put16(p + ip_len + 2, pj_sockaddr_get_port(dst));
+	}
+	put16(p + ip_len + 4, udp_len);
+	if (!ipv6) {
+		uint32_t sum = 0;
+		for (int i = 0; i < 20; i += 2)
+			sum += (p[i] << 8) | p[i + 1];
+		while (sum >> 16)
+			sum = (sum & 0xffff) + (sum >> 16);
+		put16(p + 10, ~sum & 0xffff);
+	}
+	return ip_len + 8;
+}
+
+/*
+ * SIP module, placed before the transport layer like the pjsua message
+ * logger: it sees the received messages first and the sent ones last,
+ * once they are printed in their buffer.
+ */
+static std::atomic<PacketCapture *> sip_capture {nullptr};
+static pjsip_module capture_module;
+
+// only the calls are held by PCAP_FAILED, they start with an INVITE
+static bool is_invite(const pjsip_msg *msg) {
+	return msg && msg->type == PJSIP_REQUEST_MSG && msg->line.req.method.id == PJSIP_INVITE_METHOD;
+}
+
+static pj_bool_t capture_on_rx(pjsip_rx_data *rdata) {
+	PacketCapture *capture = sip_capture.load(std::memory_order_relaxed);
+	if (!capture)
+		return PJ_FALSE;
+	uint64_t key = 0;
+	if (rdata->msg_info.cid)
+		key = PacketCapture::call_key(rdata->msg_info.cid->id.ptr, rdata->msg_info.cid->id.slen);
+	if (capture->sampled(key)) {
+		const pj_sockaddr *local = rdata->tp_info.transport ? &rdata->tp_info.transport->local_addr : nullptr;
+		capture->capture(key, &rdata->pkt_info.src_addr, local, rdata->msg_info.msg_buf, rdata->msg_info.len,
+		                 is_invite(rdata->msg_info.msg));
+	}
+	return PJ_FALSE;
+}
+
+static pj_status_t capture_on_tx(pjsip_tx_data *tdata) {
+	PacketCapture *capture = sip_capture.load(std::memory_order_relaxed);
+	if (!capture)
+		return PJ_SUCCESS;
+	uint64_t key = 0;
+	pjsip_cid_hdr *cid = (pjsip_cid_hdr *) pjsip_msg_find_hdr(tdata->msg, PJSIP_H_CALL_ID, NULL);
+	if (cid)
+		key = PacketCapture::call_key(cid->id.ptr, cid->id.slen);
+	if (capture->sampled(key)) {
+		const pj_sockaddr *local = tdata->tp_info.transport ? &tdata->tp_info.transport->local_addr : nullptr;
+		capture->capture(key, local, &tdata->tp_info.dst_addr, tdata->buf.start, tdata->buf.cur - tdata->buf.start,
+		                 is_invite(tdata->msg));
+	}
+	return PJ_SUCCESS;
+}
+
+/*
+ * Media transport adapter, between the stream and the transport created by
+ * pjsua (or its SRTP transport), every operation is passed to the base.
+ */
+struct CaptureTransport {
+	pjmedia_transport tp;   // first, the adapter is used as a pjmedia_transport
+	pjmedia_transport *base;
+	bool close_base;
+	PacketCapture *capture;
+	std::atomic<uint64_t> key;
+	pj_sockaddr local_rtp;
+	pj_sockaddr local_rtcp;
+	pj_sockaddr remote_rtp;
+	pj_sockaddr remote_rtcp;
+	// the stream attached to the adapter
+	void *stream_user_data;
+	void (*stream_rtp_cb)(void *user_data, void *pkt, pj_ssize_t size);
+	void (*stream_rtcp_cb)(void *user_data, void *pkt, pj_ssize_t size);
+#if defined(PJ_VERSION_NUM) && PJ_VERSION_NUM >= 0x02080000
+	void (*stream_rtp_cb2)(pjmedia_tp_cb_param *param);
+#endif
+};
+
+static void adapter_capture(CaptureTransport *adapter, const pj_sockaddr *src, const pj_sockaddr *dst, const void *pkt, pj_ssize_t size) {
+	uint64_t key = adapter->key.load(std::memory_order_relaxed);
+	if (size > 0 && adapter->capture->sampled(key))
+		adapter->capture->capture(key, src, dst, pkt, size);
+}
+
+static void adapter_local_addr(CaptureTransport *adapter) {
+	pjmedia_transport_info info;
+	pjmedia_transport_info_init(&info);
+	if (pjmedia_transport_get_info(adapter->base, &info) != PJ_SUCCESS)
+		return;
+	adapter->local_rtp = info.sock_info.rtp_addr_name;
+	adapter->local_rtcp = info.sock_info.rtcp_addr_name;
+}
+
+static void adapter_on_rx_rtp(void *user_data, void *pkt, pj_ssize_t size) {
+	CaptureTransport *adapter = (CaptureTransport *) user_data;
+	adapter_capture(adapter, &adapter->remote_rtp, &adapter->local_rtp, pkt, size);
+	if (adapter->stream_rtp_cb)
+		adapter->stream_rtp_cb(adapter->stream_user_data, pkt, size);
+}
+
+static void adapter_on_rx_rtcp(void *user_data, void *pkt, pj_ssize_t size) {
+	CaptureTransport *adapter = (CaptureTransport *) user_data;
+	adapter_capture(adapter, &adapter->remote_rtcp, &adapter->local_rtcp, pkt, size);
+	if (adapter->stream_rtcp_cb)
+		adapter->stream_rtcp_cb(adapter->stream_user_data, pkt, size);
+}
+
+static pj_status_t adapter_get_info(pjmedia_transport *tp, pjmedia_transport_info *info) {
+	return pjmedia_transport_get_info(((CaptureTransport *) tp)->base, info);
+}
+
+static pj_status_t adapter_attach(pjmedia_transport *tp, void *user_data, const pj_sockaddr_t *rem_addr, const pj_sockaddr_t *rem_rtcp,
+                                  unsigned addr_len, void (*rtp_cb)(void *, void *, pj_ssize_t), void (*rtcp_cb)(void *, void *, pj_ssize_t)) {
+	CaptureTransport *adapter = (CaptureTransport *) tp;
+	adapter->stream_user_data = user_data;
+	adapter->stream_rtp_cb = rtp_cb;
+	adapter->stream_rtcp_cb = rtcp_cb;
+	memcpy(&adapter->remote_rtp, rem_addr, std::min((size_t)addr_len, sizeof(pj_sockaddr)));
+	if (rem_rtcp)
+		memcpy(&adapter->remote_rtcp, rem_rtcp, std::min((size_t)addr_len, sizeof(pj_sockaddr)));
+	adapter_local_addr(adapter);
+	pj_status_t status = pjmedia_transport_attach(adapter->base, adapter, rem_addr, rem_rtcp, addr_len,
+	                                              &adapter_on_rx_rtp, &adapter_on_rx_rtcp);
+	if (status != PJ_SUCCESS) {
+		adapter->stream_user_data = NULL;
+		adapter->stream_rtp_cb = NULL;
+		adapter->stream_rtcp_cb = NULL;
+	}
+	return status;
+}
+
+#if defined(PJ_VERSION_NUM) && PJ_VERSION_NUM >= 0x02080000
+static void adapter_on_rx_rtp2(pjmedia_tp_cb_param *param) {
+	CaptureTransport *adapter = (CaptureTransport *) param->user_data;
+	adapter_capture(adapter, param->src_addr ? param->src_addr : &adapter->remote_rtp, &adapter->local_rtp, param->pkt, param->size);
+	if (adapter->stream_rtp_cb2) {
+		pjmedia_tp_cb_param stream_param = *param;
+		stream_param.user_data = adapter->stream_user_data;
+		adapter->stream_rtp_cb2(&stream_param);
+	} else if (adapter->stream_rtp_cb) {
+		adapter->stream_rtp_cb(adapter->stream_user_data, param->pkt, param->size);
+	}
+}
+
+// the streams of pjmedia 2.8 and later attach with rtp_cb2
+static pj_status_t adapter_attach2(pjmedia_transport *tp, pjmedia_transport_attach_param *att_param) {
+	CaptureTransport *adapter = (CaptureTransport *) tp;
+	adapter->stream_user_data = att_param->user_data;
+	adapter->stream_rtp_cb = att_param->rtp_cb;
+	adapter->stream_rtp_cb2 = att_param->rtp_cb2;
+	adapter->stream_rtcp_cb = att_param->rtcp_cb;
+	adapter->remote_rtp = att_param->rem_addr;
+	adapter->remote_rtcp = att_param->rem_rtcp;
+	adapter_local_addr(adapter);
+	pjmedia_transport_attach_param param = *att_param;
+	param.user_data = adapter;
+	param.rtp_cb = NULL;
+	param.rtp_cb2 = &adapter_on_rx_rtp2;
+	param.rtcp_cb = &adapter_on_rx_rtcp;
+	pj_status_t status = pjmedia_transport_attach2(adapter->base, &param);
+	if (status != PJ_SUCCESS) {
+		adapter->stream_user_data = NULL;
+		adapter->stream_rtp_cb = NULL;
+		adapter->stream_rtp_cb2 = NULL;
+		adapter->stream_rtcp_cb = NULL;
+	}
+	return status;
+}
+#endif
+
+static void adapter_detach(pjmedia_transport *tp, void *user_data) {
+	CaptureTransport *adapter = (CaptureTransport *) tp;
+	PJ_UNUSED_ARG(user_data);
+	if (!adapter->stream_user_data)
+		return;
+	pjmedia_transport_detach(adapter->base, adapter);
+	adapter->stream_user_data = NULL;
+	adapter->stream_rtp_cb = NULL;
+	adapter->stream_rtcp_cb = NULL;
+#if defined(PJ_VERSION_NUM) && PJ_VERSION_NUM >= 0x02080000
+	adapter->stream_rtp_cb2 = NULL;
+#endif
+}
+
+static pj_status_t adapter_send_rtp(pjmedia_transport *tp, const void *pkt, pj_size_t size) {
+	CaptureTransport *adapter = (CaptureTransport *) tp;
+	adapter_capture(adapter, &adapter->local_rtp, &adapter->remote_rtp, pkt, size);
+	return pjmedia_transport_send_rtp(adapter->base, pkt, size);
+}
+
+static pj_status_t adapter_send_rtcp(pjmedia_transport *tp, const void *pkt, pj_size_t size) {
+	CaptureTransport *adapter = (CaptureTransport *) tp;
+	adapter_capture(adapter, &adapter->local_rtcp, &adapter->remote_rtcp, pkt, size);
+	return pjmedia_transport_send_rtcp(adapter->base, pkt, size);
+}
+
+static pj_status_t adapter_send_rtcp2(pjmedia_transport *tp, const pj_sockaddr_t *addr, unsigned addr_len, const void *pkt, pj_size_t size) {
+	CaptureTransport *adapter = (CaptureTransport *) tp;
+	adapter_capture(adapter, &adapter->local_rtcp, addr ? (const pj_sockaddr *) addr : &adapter->remote_rtcp, pkt, size);
+	return pjmedia_transport_send_rtcp2(adapter->base, addr, addr_len, pkt, size);
+}
+
+static pj_status_t adapter_media_create(pjmedia_transport *tp, pj_pool_t *sdp_pool, unsigned options,
+                                        const pjmedia_sdp_session *remote_sdp, unsigned media_index) {
+	return pjmedia_transport_media_create(((CaptureTransport *) tp)->base, sdp_pool, options, remote_sdp, media_index);
+}
+
+static pj_status_t adapter_encode_sdp(pjmedia_transport *tp, pj_pool_t *sdp_pool, pjmedia_sdp_session *sdp_local,
+                                      const pjmedia_sdp_session *rem_sdp, unsigned media_index) {
+	return pjmedia_transport_encode_sdp(((CaptureTransport *) tp)->base, sdp_pool, sdp_local, rem_sdp, media_index);
+}
+
+static pj_status_t adapter_media_start(pjmedia_transport *tp, pj_pool_t *tmp_pool, const pjmedia_sdp_session *sdp_local,
+                                       const pjmedia_sdp_session *sdp_remote, unsigned media_index) {
+	return pjmedia_transport_media_start(((CaptureTransport *) tp)->base, tmp_pool, sdp_local, sdp_remote, media_index);
+}
+
+static pj_status_t adapter_media_stop(pjmedia_transport *tp) {
+	return pjmedia_transport_media_stop(((CaptureTransport *) tp)->base);
+}
+
+static pj_status_t adapter_simulate_lost(pjmedia_transport *tp, pjmedia_dir dir, unsigned pct_lost) {
+	return pjmedia_transport_simulate_lost(((CaptureTransport *) tp)->base, dir, pct_lost);
+}
+
+static pj_status_t adapter_destroy(pjmedia_transport *tp) {
+	CaptureTransport *adapter = (CaptureTransport *) tp;
+	if (adapter->close_base)
+		pjmedia_transport_close(adapter->base);
+	delete adapter;
+	return PJ_SUCCESS;
+}
+
+static pjmedia_transport_op adapter_op() {
+	pjmedia_transport_op op;
+	memset(&op, 0, sizeof(op));
+	op.get_info = &adapter_get_info;
+	op.attach = &adapter_attach;
+	op.detach = &adapter_detach;
+	op.send_rtp = &adapter_send_rtp;
+	op.send_rtcp = &adapter_send_rtcp;
+	op.send_rtcp2 = &adapter_send_rtcp2;
+	op.media_create = &adapter_media_create;
+	op.encode_sdp = &adapter_encode_sdp;
+	op.media_start = &adapter_media_start;
+	op.media_stop = &adapter_media_stop;
+	op.simulate_lost = &adapter_simulate_lost;
+	op.destroy = &adapter_destroy;
+#if defined(PJ_VERSION_NUM) && PJ_VERSION_NUM >= 0x02080000
+	op.attach2 = &adapter_attach2;
+#endif
+	return op;
+}
+
+/*
+ * PacketCapture implementation
+ */
+// without slots nothing is allocated, the capture can not be started
+PacketCapture::PacketCapture(unsigned slot_count) : slots(slot_count), free_slots(slot_count), queue(slot_count),
+                                                     results(slot_count ? VP_PCAP_DECISIONS : 0) {
+	for (CapturePacket &slot : slots) {
+		CapturePacket *packet = &slot;
+		free_slots.push(packet);
+	}
+}
+
+PacketCapture::~PacketCapture() {
+	stop();
+}
+
+bool PacketCapture::start(const std::string &file_name, pcap_filter_t p_filter, unsigned p_sample_percent) {
+	if (running)
+		return true;
+	if (slots.empty())
+		return false;
+	file = fopen(file_name.c_str(), "w");
+	if (!file) {
+		LOG(logERROR) <<__FUNCTION__<<": can not open pcap file["<<file_name<<"]: "<<strerror(errno);
+		return false;
+	}
+	// the writer is the only thread writing the file, a large buffer is enough
+	setvbuf(file, NULL, _IOFBF, 1 << 20);
+	uint32_t magic = PCAP_MAGIC;
+	uint16_t version[2] = {2, 4};
+	int32_t thiszone = 0;
+	uint32_t sigfigs = 0;
+	uint32_t snaplen = VP_PCAP_SNAPLEN;
+	uint32_t linktype = PCAP_LINKTYPE_RAW;
+	fwrite(&magic, sizeof(magic), 1, file);
+	fwrite(version, sizeof(version), 1, file);
+	fwrite(&thiszone, sizeof(thiszone), 1, file);
+	fwrite(&sigfigs, sizeof(sigfigs), 1, file);
+	fwrite(&snaplen, sizeof(snaplen), 1, file);
+	fwrite(&linktype, sizeof(linktype), 1, file);
+
+	filter = p_filter;
+	sample_percent = std::min(p_sample_percent, 100u);
+	running = true;
+	writer = std::thread(&PacketCapture::run, this);
+
+	memset(&capture_module, 0, sizeof(capture_module));
+	capture_module.name = pj_str((char *)"mod-vp-pcap");
+	capture_module.id = -1;
+	capture_module.priority = PJSIP_MOD_PRIORITY_TRANSPORT_LAYER - 1;
+	capture_module.on_rx_request = &capture_on_rx;
+	capture_module.on_rx_response = &capture_on_rx;
+	capture_module.on_tx_request = &capture_on_tx;
+	capture_module.on_tx_response = &capture_on_tx;
+	pj_status_t status = pjsip_endpt_register_module(pjsua_get_pjsip_endpt(), &capture_module);
+	if (status != PJ_SUCCESS)
+		LOG(logERROR) <<__FUNCTION__<<": SIP capture module not registered status["<<status<<"], only RTP is captured";
+	else
+		sip_capture = this;
+	LOG(logINFO) <<__FUNCTION__<<": pcap["<<file_name<<"] filter["<<(filter == PCAP_FAILED ? "failed" : "all")
+	             <<"] sample["<<sample_percent<<"%] slots["<<slots.size()<<"]";
+	return true;
+}
+
+void PacketCapture::stop() {
+	if (!running)
+		return;
+	sip_capture = nullptr;
+	running = false;
+	writer.join();
+	for (auto &it : pending)
+		discarded += it.second.records.size();
+	pending.clear();
+	pending_bytes = 0;
+	decided.clear();
+	fclose(file);
+	file = nullptr;
+	LOG(logINFO) <<__FUNCTION__<<": pcap captured["<<captured<<"] written["<<written<<"] discarded["<<discarded
+	             <<"] dropped["<<dropped<<"] lost_results["<<lost_results<<"]";
+}
+
+// FNV-1a, the SIP module and the calls get the same key from the Call-ID
+uint64_t PacketCapture::call_key(const char *call_id, size_t len) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (uint8_t)call_id[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+bool PacketCapture::sampled(uint64_t key) const {
+	return sample_percent >= 100 || key % 100 < sample_percent;
+}
+
+CapturePacket * PacketCapture::get_slot() {
+	CapturePacket *packet = nullptr;
+	if (!free_slots.pop(packet))
+		return nullptr;
+	return packet;
+}
+
+void PacketCapture::release(CapturePacket *packet) {
+	free_slots.push(packet);
+}
+
+void PacketCapture::capture(uint64_t key, const pj_sockaddr *src, const pj_sockaddr *dst, const void *payload, size_t len,
+                            bool starts_call) {
+	if (!running || !payload)
+		return;
+	CapturePacket *packet = get_slot();
+	if (!packet) {
+		dropped++;
+		return;
+	}
+	size_t header_len = put_headers(packet->data, src, dst, len);
+	size_t copy_len = std::min(len, (size_t)VP_PCAP_SNAPLEN - header_len);
+	memcpy(packet->data + header_len, payload, copy_len);
+	packet->key = key;
+	packet->ts_us = now_us();
+	packet->len = header_len + len;
+	packet->caplen = header_len + copy_len;
+	packet->starts_call = starts_call;
+	// there are as many cells as slots, it can not be full
+	queue.push(packet);
+	captured++;
+}
+
+void PacketCapture::call_result(const std::string &call_id, bool success) {
+	if (!running || filter != PCAP_FAILED || call_id.empty())
+		return;
+	uint64_t key = call_key(call_id);
+	if (!sampled(key))
+		return;
+	CallResult result = {key, !success};
+	// a lost result leaves the packets of the call held until they expire
+	if (!results.push(result))
+		lost_results++;
+}
+
+void PacketCapture::write_record(const CapturePacket *packet) {
+	uint32_t header[4] = {(uint32_t)(packet->ts_us / 1000000), (uint32_t)(packet->ts_us % 1000000), packet->caplen, packet->len};
+	fwrite(header, sizeof(header), 1, file);
+	fwrite(packet->data, packet->caplen, 1, file);
+	written++;
+}
+
+void PacketCapture::write_record(const std::string &record) {
+	fwrite(record.data(), record.size(), 1, file);
+	written++;
+}
+
+void PacketCapture::decide(const CallResult &result) {
+	decided[result.key] = Decision{result.keep, now_us()};
+	auto it = pending.find(result.key);
+	if (it == pending.end())
+		return;
+	for (const std::string &record : it->second.records) {
+		if (result.keep)
+			write_record(record);
+		pending_bytes -= record.size();
+	}
+	if (!result.keep)
+		discarded += it->second.records.size();
+	pending.erase(it);
+}
+
+void PacketCapture::handle(CapturePacket *packet) {
+	if (filter == PCAP_ALL) {
+		write_record(packet);
+		return;
+	}
+	// the packets after the result (BYE, last RTP) follow it
+	auto decision = decided.find(packet->key);
+	if (decision != decided.end()) {
+		if (decision->second.keep)
+			write_record(packet);
+		else
+			discarded++;
+		return;
+	}
+	// only the calls get a result: REGISTER, OPTIONS and the packets of
+	// an unknown Call-ID are not held
+	auto it = pending.find(packet->key);
+	if (it == pending.end()) {
+		if (!packet->starts_call || packet->key == 0) {
+			discarded++;
+			return;
+		}
+		it = pending.emplace(packet->key, Pending()).first;
+	}
+	size_t size = sizeof(uint32_t) * 4 + packet->caplen;
+	if (pending_bytes + size > VP_PCAP_PENDING_BYTES) {
+		discarded++;
+		return;
+	}
+	// held as a pcap record, the slot goes back to the producers
+	uint32_t header[4] = {(uint32_t)(packet->ts_us / 1000000), (uint32_t)(packet->ts_us % 1000000), packet->caplen, packet->len};
+	std::string record((const char *)header, sizeof(header));
+	record.append((const char *)packet->data, packet->caplen);
+	it->second.records.push_back(std::move(record));
+	it->second.last_us = packet->ts_us;
+	pending_bytes += size;
+}
+
+void PacketCapture::expire(uint64_t now) {
+	for (auto it = pending.begin(); it != pending.end(); ) {
+		if (now - it->second.last_us > (uint64_t)VP_PCAP_PENDING_SECONDS * 1000000) {
+			discarded += it->second.records.size();
+			for (const std::string &record : it->second.records)
+				pending_bytes -= record.size();
+			it = pending.erase(it);
+		} else {
+			++it;
+		}
+	}
+	for (auto it = decided.begin(); it != decided.end(); ) {
+		if (now - it->second.ts_us > (uint64_t)PCAP_DECISION_SECONDS * 1000000)
+			it = decided.erase(it);
+		else
+			++it;
+	}
+}
+
+void PacketCapture::run() {
+	uint64_t last_expire = now_us();
+	while (true) {
+		// the queue is drained once more after the stop
+		bool stopping = !running;
+		bool idle = true;
+		CapturePacket *packet;
+		while (queue.pop(packet)) {
+			handle(packet);
+			release(packet);
+			idle = false;
+		}
+		CallResult result;
+		while (results.pop(result)) {
+			decide(result);
+			idle = false;
+		}
+		if (stopping)
+			break;
+		uint64_t now = now_us();
+		if (now - last_expire > 1000000) {
+			expire(now);
+			last_expire = now;
+		}
+		// the producers never wake the writer up, it polls
+		if (idle)
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	fflush(file);
+}
+
+pjmedia_transport * PacketCapture::wrap_media(pjmedia_transport *base, bool close_base, std::atomic<uint64_t> **key) {
+	static pjmedia_transport_op op = adapter_op();
+	CaptureTransport *adapter = new CaptureTransport();
+	pj_ansi_strncpy(adapter->tp.name, "vp_pcap", sizeof(adapter->tp.name));
+	adapter->tp.type = PJMEDIA_TRANSPORT_TYPE_USER;
+	adapter->tp.op = &op;
+	adapter->base = base;
+	adapter->close_base = close_base;
+	adapter->capture = this;
+	adapter->key = 0;
+	if (key)
+		*key = &adapter->key;
+	return &adapter->tp;
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2016-2018 Julien Chavanton <jchavanton@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA~
+ */
+
+
+#ifndef VOIP_PATROL_PCAP_H
+#define VOIP_PATROL_PCAP_H
+
+#include <pjsua2.hpp>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "ring_queue.hh"
+
+#define VP_PCAP_SNAPLEN 4096          // IP and UDP headers included, longer packets are truncated
+#define VP_PCAP_BUFFER 8192           // default packet slots
+#define VP_PCAP_PENDING_SECONDS 300   // packets of a call without a result are dropped after this idle time
+#define VP_PCAP_PENDING_BYTES (256 << 20) // packets held for the calls without a result, above they are dropped
+#define VP_PCAP_DECISIONS 65536       // call results waiting for the writer
+
+typedef enum pcap_filter {
+	PCAP_ALL,       // every captured packet is written
+	PCAP_FAILED     // packets are held until the result of the call, only failed calls are written
+} pcap_filter_t;
+
+/*
+ * One captured packet, the IP and UDP headers are synthesized in front of
+ * the payload so the file can be written as LINKTYPE_RAW.
+ * Slots are allocated once, the producers never allocate.
+ */
+struct CapturePacket {
+	uint64_t key;       // hash of the Call-ID, 0: not related to a known call
+	uint64_t ts_us;     // wall clock
+	uint32_t len;       // length on the wire
+	uint32_t caplen;    // length copied in data
+	bool starts_call;   // INVITE out of a known call, its packets are held until the call result
+	uint8_t data[VP_PCAP_SNAPLEN];
+};
+
+/*
+ * SIP and RTP capture: a pjsip module and a media transport adapter copy
+ * the packets in preallocated slots pushed in a lock-free queue, a writer
+ * thread writes them to the pcap file. The producers never block, when no
+ * slot is free the packet is dropped and counted.
+ * SIP is captured after TLS decryption, TCP and TLS messages are written
+ * as UDP datagrams between the same addresses.
+ * Nothing is registered when the capture is not enabled.
+ */
+class PacketCapture {
+	public:
+		PacketCapture(unsigned slots);
+		~PacketCapture();
+		PacketCapture(const PacketCapture &) = delete;
+		PacketCapture & operator=(const PacketCapture &) = delete;
+		// after libInit, registers the SIP module
+		bool start(const std::string &file_name, pcap_filter_t filter, unsigned sample_percent);
+		// waits for the writer to drain the queue
+		void stop();
+		bool is_running() const { return running; }
+		static uint64_t call_key(const char *call_id, size_t len);
+		static uint64_t call_key(const std::string &call_id) { return call_key(call_id.data(), call_id.size()); }
+		// the call is in the sample, cheap enough to be checked for every packet
+		bool sampled(uint64_t key) const;
+		void capture(uint64_t key, const pj_sockaddr *src, const pj_sockaddr *dst, const void *payload, size_t len,
+		             bool starts_call=false);
+		// the result of a call, with PCAP_FAILED its packets are written when it failed, never blocks
+		void call_result(const std::string &call_id, bool success);
+		// wraps a call media transport, RTP is seen before SRTP, key is set to
+		// the Call-ID hash by the call once it is known
+		pjmedia_transport * wrap_media(pjmedia_transport *base, bool close_base, std::atomic<uint64_t> **key);
+		std::atomic<unsigned long> captured {0};
+		std::atomic<unsigned long> dropped {0};    // no free slot
+		std::atomic<unsigned long> lost_results {0}; // decision queue full, the call expires
+	private:
+		struct Pending {
+			std::vector<std::string> records;
+			uint64_t last_us;
+		};
+		struct Decision {
+			bool keep;
+			uint64_t ts_us;
+		};
+		// call result, queued apart from the packets so it never waits for a slot
+		struct CallResult {
+			uint64_t key;
+			bool keep;
+		};
+		CapturePacket * get_slot();
+		void release(CapturePacket *packet);
+		void run();
+		void handle(CapturePacket *packet);
+		void decide(const CallResult &result);
+		void write_record(const CapturePacket *packet);
+		void write_record(const std::string &record);
+		void expire(uint64_t now_us);
+		std::vector<CapturePacket> slots;
+		RingQueue<CapturePacket *> free_slots;
+		RingQueue<CapturePacket *> queue;
+		RingQueue<CallResult> results;
+		std::thread writer;
+		std::atomic<bool> running {false};
+		FILE *file {nullptr};
+		pcap_filter_t filter {PCAP_ALL};
+		unsigned sample_percent {100};
+		// only used by the writer thread
+		std::unordered_map<uint64_t, Pending> pending;
+		std::unordered_map<uint64_t, Decision> decided;
+		size_t pending_bytes {0};
+		unsigned long written {0};
+		unsigned long discarded {0};
+};
+
+#endif
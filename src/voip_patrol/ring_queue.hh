@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2016-2018 Julien Chavanton <jchavanton@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA~
+ */
+
+#ifndef VOIP_PATROL_RING_QUEUE_H
+#define VOIP_PATROL_RING_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+/*
+ * Bounded lock-free queue, any number of producers and consumers.
+ * Every cell carries a sequence number telling if it is ready to be
+ * written or read for the current lap around the ring, push and pop
+ * only contend on one atomic position each.
+ * The capacity is rounded up to a power of two.
+ */
+template <typename T>
+class RingQueue {
+	public:
+		RingQueue(size_t min_capacity) {
+			capacity = 2;
+			while (capacity < min_capacity)
+				capacity <<= 1;
+			mask = capacity - 1;
+			cells = new Cell[capacity];
+			for (size_t i = 0; i < capacity; i++)
+				cells[i].sequence.store(i, std::memory_order_relaxed);
+			enqueue_pos.store(0, std::memory_order_relaxed);
+			dequeue_pos.store(0, std::memory_order_relaxed);
+		}
+		~RingQueue() {
+			delete [] cells;
+		}
+		RingQueue(const RingQueue &) = delete;
+		RingQueue & operator=(const RingQueue &) = delete;
+
+		// returns false when the queue is full, the value is left untouched
+		bool push(T &value) {
+			Cell *cell;
+			size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+			while (true) {
+				cell = &cells[pos & mask];
+				size_t seq = cell->sequence.load(std::memory_order_acquire);
+				intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+				if (diff == 0) {
+					if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						break;
+				} else if (diff < 0) {
+					return false;
+				} else {
+					pos = enqueue_pos.load(std::memory_order_relaxed);
+				}
+			}
+			cell->data = std::move(value);
+			cell->sequence.store(pos + 1, std::memory_order_release);
+			return true;
+		}
+
+		// returns false when the queue is empty
+		bool pop(T &value) {
+			Cell *cell;
+			size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+			while (true) {
+				cell = &cells[pos & mask];
+				size_t seq = cell->sequence.load(std::memory_order_acquire);
+				intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+				if (diff == 0) {
+					if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						break;
+				} else if (diff < 0) {
+					return false;
+				} else {
+					pos = dequeue_pos.load(std::memory_order_relaxed);
+				}
+			}
+			value = std::move(cell->data);
+			cell->sequence.store(pos + mask + 1, std::memory_order_release);
+			return true;
+		}
+
+		bool empty() const {
+			return enqueue_pos.load(std::memory_order_acquire) == dequeue_pos.load(std::memory_order_acquire);
+		}
+
+		size_t size() const { return capacity; }
+
+	private:
+		struct Cell {
+			std::atomic<size_t> sequence;
+			T data;
+		};
+		// the positions are on their own cache lines, producers and consumer do not share them
+		alignas(64) std::atomic<size_t> enqueue_pos;
+		alignas(64) std::atomic<size_t> dequeue_pos;
+		alignas(64) Cell *cells;
+		size_t capacity;
+		size_t mask;
+};
+
+#endif
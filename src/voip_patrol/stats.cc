@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2016-2018 Julien Chavanton <jchavanton@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA~
+ */
+
+#include "stats.hh"
+#include <sys/mman.h>
+#include <new>
+#include <algorithm>
+#include <chrono>
+
+SharedStats * shared_stats_create(unsigned workers) {
+	if (workers == 0 || workers > VP_MAX_WORKERS)
+		return nullptr;
+	// anonymous and shared: inherited by the children, nothing to clean up on disk
+	void *mem = mmap(nullptr, sizeof(SharedStats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return nullptr;
+	SharedStats *stats = new (mem) SharedStats();
+	stats->workers = workers;
+	stats->result_seq = 0;
+	for (unsigned i = 0; i < VP_MAX_WORKERS; i++) {
+		WorkerCounters &w = stats->worker[i];
+		w.pid = 0;
+		w.calls = 0;
+		w.results = 0;
+		w.passed = 0;
+		w.failed = 0;
+		w.refreshes = 0;
+	}
+	return stats;
+}
+
+void shared_stats_destroy(SharedStats *stats) {
+	if (!stats)
+		return;
+	stats->~SharedStats();
+	munmap(stats, sizeof(SharedStats));
+}
+
+WorkerCounters * shared_stats_total(const SharedStats *stats, WorkerCounters *total) {
+	unsigned long calls = 0, results = 0, passed = 0, failed = 0, refreshes = 0;
+	for (unsigned i = 0; i < stats->workers; i++) {
+		const WorkerCounters &w = stats->worker[i];
+		calls += w.calls;
+		results += w.results;
+		passed += w.passed;
+		failed += w.failed;
+		refreshes += w.refreshes;
+	}
+	total->pid = 0;
+	total->calls = calls;
+	total->results = results;
+	total->passed = passed;
+	total->failed = failed;
+	total->refreshes = refreshes;
+	return total;
+}
+
+/*
+ * LatencyHistogram implementation
+ */
+
+LatencyHistogram::LatencyHistogram() {
+	for (unsigned i = 0; i < LATENCY_BUCKETS; i++)
+		counts[i] = 0;
+	total = 0;
+	sum = 0;
+	maximum = 0;
+}
+
+unsigned LatencyHistogram::index(uint64_t us) {
+	if (us < LATENCY_SUB_BUCKETS)
+		return us;
+	if (us >> LATENCY_MAX_BITS)
+		us = (1ULL << LATENCY_MAX_BITS) - 1;
+	unsigned msb = 63 - __builtin_clzll(us);
+	unsigned shift = msb - LATENCY_SUB_BITS + 1;
+	unsigned sub = us >> shift; // in [LATENCY_SUB_BUCKETS / 2, LATENCY_SUB_BUCKETS)
+	return LATENCY_SUB_BUCKETS + (shift - 1) * LATENCY_SUB_BUCKETS / 2 + sub - LATENCY_SUB_BUCKETS / 2;
+}
+
+uint64_t LatencyHistogram::highest(unsigned index) {
+	if (index < LATENCY_SUB_BUCKETS)
+		return index;
+	index -= LATENCY_SUB_BUCKETS;
+	unsigned shift = index / (LATENCY_SUB_BUCKETS / 2) + 1;
+	uint64_t sub = index % (LATENCY_SUB_BUCKETS / 2) + LATENCY_SUB_BUCKETS / 2;
+	return ((sub + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t us) {
+	counts[index(us)].fetch_add(1, std::memory_order_relaxed);
+	sum.fetch_add(us, std::memory_order_relaxed);
+	uint64_t seen = maximum.load(std::memory_order_relaxed);
+	while (us > seen && !maximum.compare_exchange_weak(seen, us, std::memory_order_relaxed))
+		;
+	total.fetch_add(1, std::memory_order_release);
+}
+
+double LatencyHistogram::mean() const {
+	uint64_t n = total;
+	return n ? (double)sum / n : 0.0;
+}
+
+uint64_t LatencyHistogram::percentile(double percent) const {
+	uint64_t n = total.load(std::memory_order_acquire);
+	if (n == 0)
+		return 0;
+	uint64_t rank = (uint64_t)(percent / 100.0 * n + 0.5);
+	if (rank < 1)
+		rank = 1;
+	uint64_t seen = 0;
+	for (unsigned i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += counts[i].load(std::memory_order_relaxed);
+		if (seen >= rank)
+			return std::min(highest(i), (uint64_t)maximum);
+	}
+	return maximum;
+}
+
+/*
+ * RateMeter implementation
+ */
+
+bool RateMeter::add(double *mean, unsigned long *peak) {
+	int64_t now = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	total++;
+	std::lock_guard<std::mutex> guard(lock);
+	if (window_start < 0) {
+		window_start = now;
+		second = now;
+	}
+	if (now != second) {
+		window_peak = std::max(window_peak, second_count);
+		second_count = 0;
+		second = now;
+	}
+	second_count++;
+	window_count++;
+	if (now - window_start < window)
+		return false;
+	// the current second is not over, it starts the next window
+	*mean = (double)(window_count - second_count) / (now - window_start);
+	*peak = window_peak;
+	window_start = now;
+	window_count = second_count;
+	window_peak = 0;
+	return true;
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2016-2018 Julien Chavanton <jchavanton@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA~
+ */
+
+#ifndef VOIP_PATROL_STATS_H
+#define VOIP_PATROL_STATS_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <sys/types.h>
+
+#define VP_MAX_WORKERS 64
+#define VP_WORKERS_STATS_MS 10000 // the supervisor reports the workers counters this often
+
+static_assert(ATOMIC_LONG_LOCK_FREE == 2, "the shared counters must be lock free to be used across processes");
+
+/* counters of one worker process, only written by that worker */
+struct WorkerCounters {
+	std::atomic<pid_t> pid;
+	std::atomic<unsigned long> calls;   // calls made by the call generators
+	std::atomic<unsigned long> results; // results written
+	std::atomic<unsigned long> passed;
+	std::atomic<unsigned long> failed;
+	std::atomic<unsigned long> refreshes; // registrations refreshed by pjsua
+};
+
+/*
+ * Shared memory segment mapped by the supervisor before the workers are
+ * forked, every process sees the same counters without any system call.
+ */
+struct SharedStats {
+	unsigned workers;
+	std::atomic<unsigned long> result_seq; // result keys, unique across the workers
+	WorkerCounters worker[VP_MAX_WORKERS];
+};
+
+SharedStats * shared_stats_create(unsigned workers);
+void shared_stats_destroy(SharedStats *stats);
+// sum of the counters of every worker
+WorkerCounters * shared_stats_total(const SharedStats *stats, WorkerCounters *total);
+
+/*
+ * Latency distribution in the HDR histogram layout: the values below
+ * LATENCY_SUB_BUCKETS are exact, above every power of two is split in
+ * LATENCY_SUB_BUCKETS / 2 linear buckets, about 1.6% of precision up to
+ * 2^40 us with a fixed memory. Recorded from any thread without a lock.
+ */
+#define LATENCY_SUB_BITS 7
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BITS 40
+#define LATENCY_BUCKETS (LATENCY_SUB_BUCKETS + (LATENCY_MAX_BITS - LATENCY_SUB_BITS) * LATENCY_SUB_BUCKETS / 2)
+
+class LatencyHistogram {
+	public:
+		LatencyHistogram();
+		void record(uint64_t us);
+		uint64_t count() const { return total; }
+		uint64_t max() const { return maximum; }
+		double mean() const;
+		// us, the highest value of the bucket holding that percentile, 0 when empty
+		uint64_t percentile(double percent) const;
+	private:
+		static unsigned index(uint64_t us);
+		static uint64_t highest(unsigned index);
+		std::atomic<uint64_t> counts[LATENCY_BUCKETS];
+		std::atomic<uint64_t> total;
+		std::atomic<uint64_t> sum;
+		std::atomic<uint64_t> maximum;
+};
+
+/*
+ * Events per second over a reporting window, the busiest second of the
+ * window tells the bursts that the mean hides.
+ */
+class RateMeter {
+	public:
+		RateMeter(unsigned window_seconds) : window(window_seconds) {}
+		// counts one event, true once per window with its mean and peak per second
+		bool add(double *mean, unsigned long *peak);
+		unsigned long count() const { return total; }
+	private:
+		std::mutex lock;
+		unsigned window;
+		int64_t window_start {-1};
+		int64_t second {-1};
+		unsigned long second_count {0};
+		unsigned long window_count {0};
+		unsigned long window_peak {0};
+		std::atomic<unsigned long> total {0};
+};
+
+#endif
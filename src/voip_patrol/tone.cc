@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2016-2018 Julien Chavanton <jchavanton@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA~
+ */
+
+#include "tone.hh"
+#include "log.h"
+#include <cstdlib>
+
+#define TONE_MIN_POWER 1e-5f    // -50 dBFS, quieter blocks are not analyzed
+#define TONE_MIN_RATIO 0.4f     // share of the block energy at the tone frequency
+#define TONE_MIN_BLOCKS 4       // a tone shorter than 80 ms is not reported
+#define DTMF_MIN_RATIO 0.15f    // each of the two frequencies
+#define DTMF_PAIR_RATIO 0.6f    // both frequencies together
+#define DTMF_MAX_TWIST 6.3f     // 8 dB
+
+static const float dtmf_freqs[8] = {697.0f, 770.0f, 852.0f, 941.0f, 1209.0f, 1336.0f, 1477.0f, 1633.0f};
+static const char dtmf_keys[4][4] = {
+	{'1', '2', '3', 'A'},
+	{'4', '5', '6', 'B'},
+	{'7', '8', '9', 'C'},
+	{'*', '0', '#', 'D'},
+};
+
+std::string ToneReport::dtmf() const {
+	std::string res;
+	for (const Digit &d : digits)
+		res += d.digit;
+	return res;
+}
+
+std::vector<unsigned> parse_tone_list(const std::string &list) {
+	std::vector<unsigned> tones;
+	size_t pos = 0;
+	while (pos < list.size()) {
+		size_t end = list.find(',', pos);
+		if (end == std::string::npos)
+			end = list.size();
+		unsigned freq = atoi(list.substr(pos, end - pos).c_str());
+		if (freq)
+			tones.push_back(freq);
+		pos = end + 1;
+	}
+	return tones;
+}
+
+
+/*
+ * ToneDetector implementation
+ */
+
+ToneDetector::ToneDetector(unsigned clock_rate, const std::vector<unsigned> &tones, bool p_dtmf) : dtmf(p_dtmf) {
+	float freqs[DSP_TONES];
+	unsigned count = 0;
+	if (dtmf) {
+		for (int i = 0; i < 8; i++)
+			freqs[count++] = dtmf_freqs[i];
+	}
+	first_tone = count;
+	for (unsigned freq : tones) {
+		if (count == DSP_TONES) {
+			LOG(logERROR) <<__FUNCTION__<<": too many tones, ["<<freq<<"] and the following ones are not detected";
+			break;
+		}
+		// over the Nyquist frequency a tone would alias
+		if (freq * 2 >= clock_rate) {
+			LOG(logERROR) <<__FUNCTION__<<": tone ["<<freq<<"] can not be detected at "<<clock_rate<<"Hz";
+			continue;
+		}
+		freqs[count++] = freq;
+		ToneReport::Tone tone;
+		tone.freq = freq;
+		result.tones.push_back(tone);
+	}
+	dsp_goertzel_init(&goertzel, clock_rate, freqs, count);
+	block.resize(clock_rate * TONE_BLOCK_MS / 1000);
+	runs.resize(result.tones.size());
+}
+
+void ToneDetector::process(const int16_t *samples, size_t count) {
+	while (count) {
+		size_t n = block.size() - fill;
+		if (n > count)
+			n = count;
+		dsp_int16_to_float(samples, &block[fill], n);
+		samples += n;
+		count -= n;
+		fill += n;
+		if (fill == block.size()) {
+			process_block();
+			fill = 0;
+		}
+	}
+}
+
+void ToneDetector::process_block() {
+	size_t len = block.size();
+	unsigned start_ms = blocks * TONE_BLOCK_MS;
+	blocks++;
+	float energy = dsp_energy(&block[0], len);
+	float ratio[DSP_TONES] = {0.0f};
+	if (energy / len > TONE_MIN_POWER) {
+		// a pure sine at the filter frequency gives 1
+		dsp_goertzel_power(&goertzel, &block[0], len, ratio);
+		dsp_scale(ratio, 2.0f / (len * energy), DSP_TONES);
+	}
+	if (dtmf) {
+		int row = 0, col = 4;
+		for (int i = 1; i < 4; i++) {
+			if (ratio[i] > ratio[row])
+				row = i;
+			if (ratio[4 + i] > ratio[col])
+				col = 4 + i;
+		}
+		float low = ratio[row], high = ratio[col];
+		char found = 0;
+		if (low > DTMF_MIN_RATIO && high > DTMF_MIN_RATIO && low + high > DTMF_PAIR_RATIO
+		    && low < high * DTMF_MAX_TWIST && high < low * DTMF_MAX_TWIST)
+			found = dtmf_keys[row][col - 4];
+		if (found && found == digit && !digit_reported) {
+			ToneReport::Digit d;
+			d.digit = found;
+			d.ms = start_ms - TONE_BLOCK_MS;
+			result.digits.push_back(d);
+			digit_reported = true;
+		} else if (found != digit) {
+			digit_reported = false;
+		}
+		digit = found;
+	}
+	for (size_t i = 0; i < result.tones.size(); i++) {
+		ToneReport::Tone &tone = result.tones[i];
+		if (ratio[first_tone + i] < TONE_MIN_RATIO) {
+			runs[i] = 0;
+			continue;
+		}
+		runs[i]++;
+		if (runs[i] < TONE_MIN_BLOCKS)
+			continue;
+		if (runs[i] == TONE_MIN_BLOCKS) {
+			if (tone.first_ms < 0)
+				tone.first_ms = start_ms - (TONE_MIN_BLOCKS - 1) * TONE_BLOCK_MS;
+			tone.duration_ms += (TONE_MIN_BLOCKS - 1) * TONE_BLOCK_MS;
+		}
+		tone.duration_ms += TONE_BLOCK_MS;
+	}
+}
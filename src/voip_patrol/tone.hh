@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2016-2018 Julien Chavanton <jchavanton@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA~
+ */
+
+#ifndef VOIP_PATROL_TONE_H
+#define VOIP_PATROL_TONE_H
+
+#include "dsp.hh"
+#include <string>
+#include <vector>
+
+#define TONE_BLOCK_MS 20
+
+struct ToneReport {
+	struct Tone {
+		unsigned freq {0};
+		long first_ms {-1};       // -1: never detected
+		unsigned duration_ms {0};
+	};
+	struct Digit {
+		char digit;
+		unsigned ms;
+	};
+	std::vector<Tone> tones;
+	std::vector<Digit> digits;
+	std::string dtmf() const;
+};
+
+/*
+ * Tones and in-band DTMF in the received audio of a call, every block of
+ * TONE_BLOCK_MS goes through one Goertzel filter per frequency, a digit is
+ * reported once found in two consecutive blocks, a tone in four.
+ */
+class ToneDetector {
+	public:
+		ToneDetector(unsigned clock_rate, const std::vector<unsigned> &tones, bool dtmf);
+		void process(const int16_t *samples, size_t count);
+		const ToneReport & report() const { return result; }
+	private:
+		void process_block();
+		dsp_goertzel goertzel;   // DTMF rows and columns first when enabled, then the tones
+		unsigned first_tone {0}; // lane of the first tone
+		bool dtmf;
+		std::vector<float> block;
+		size_t fill {0};
+		unsigned blocks {0};
+		char digit {0};          // digit found in the previous block
+		bool digit_reported {false};
+		std::vector<unsigned> runs; // consecutive blocks each tone was found in
+		ToneReport result;
+};
+
+// "1000,2600" in Hz
+std::vector<unsigned> parse_tone_list(const std::string &list);
+
+#endif
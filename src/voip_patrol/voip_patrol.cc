@@ -18,15 +18,22 @@
 
 #include "voip_patrol.hh"
 #include "action.hh"
+#include "json.hh"
+#include "mos.hh"
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
 #define THIS_FILE "voip_patrol.cpp"
 
 using namespace pj;
 
 
+// "DD-MM-YYYY HH:MM:SS", str_now holds 20 chars
 void get_time_string(char * str_now) {
-	time_t t = time(0);   // get time now
-	struct tm * now = localtime( & t );
-	sprintf(str_now,"%02d-%02d-%04d %02d:%02d:%02d", now->tm_mday, now->tm_mon+1, now->tm_year+1900, now->tm_hour, now->tm_min, now->tm_sec);
+	clock_date_time(str_now);
 }
 
 call_state_t get_call_state_from_string (string state) {
@@ -39,6 +46,31 @@ call_state_t get_call_state_from_string (string state) {
 	return INV_STATE_NULL;
 }
 
+static std::string remote_user_from_uri(const std::string &uri) {
+	int uri_prefix = 3; // sip:
+	std::size_t pos = uri.find("@");
+	if (uri[0] != '<')
+		uri_prefix++;
+	if (pos == std::string::npos)
+		return "";
+	return uri.substr(uri_prefix, pos - uri_prefix);
+}
+
+static void set_record_fn(TestCall* call, const CallInfo &ci, const char *caller_contact) {
+	char rec_fn[1024] = "voice_ref_files/recording.wav";
+	snprintf(rec_fn, sizeof(rec_fn), "voice_files/%s_%s_rec.wav", ci.callIdString.c_str(), caller_contact);
+	call->test->record_fn = string(&rec_fn[0]);
+}
+
+static CaptureSink *create_capture(Test *test, Config *config, unsigned clock_rate, unsigned samples_per_frame) {
+	// only the tone detector needs the audio when it is neither scored nor recorded
+	unsigned seconds = test->min_mos > 0 || test->recording ? config->capture_seconds : 0;
+	CaptureSink *capture = new CaptureSink(clock_rate, samples_per_frame, seconds);
+	if (test->detects())
+		capture->detector.reset(new ToneDetector(clock_rate, test->detect_tones, !test->detect_dtmf.empty()));
+	return capture;
+}
+
 string get_call_state_string (call_state_t state) {
 	if (state == INV_STATE_CALLING) return "CALLING";
 	if (state == INV_STATE_INCOMING) return "INCOMING";
@@ -56,12 +88,28 @@ string get_call_state_string (call_state_t state) {
 TestCall::TestCall(TestAccount *p_acc, int call_id) : Call(*p_acc, call_id) {
 	test = NULL;
 	acc = p_acc;
-	recorder_id = -1;
 	player_id = -1;
+	playback = nullptr;
+	capture = nullptr;
+	media_link = nullptr;
+	generator = nullptr;
+	making_call = false;
+	disconnected = false;
 	role = -1; // Caller 0 | callee 1
+	sip_transport = nullptr;
+	capture_key = nullptr;
+	pj_timer_entry_init(&timer, 0, this, &TestCall::on_timer);
+	pj_timer_entry_init(&rtp_sampler, 0, this, &TestCall::on_rtp_sampler);
 }
 
 TestCall::~TestCall() {
+	cancel_timer();
+	pjsua_cancel_timer(&rtp_sampler);
+	delete playback;
+	release_media();
+	delete capture;
+	if (sip_transport)
+		pjsip_transport_dec_ref(sip_transport);
 	if (test) {
 		LOG(logINFO) << "delete call test["<<test<<"]";
 		delete test;
@@ -72,6 +120,123 @@ void TestCall::setTest(Test *p_test) {
 	test = p_test;
 }
 
+// the first transport seen is the one of the call, kept until it is disconnected
+void TestCall::track_transport(pjsip_transport *transport) {
+	if (sip_transport || !test || !transport || !(transport->flag & PJSIP_TRANSPORT_SECURE))
+		return;
+	pjsip_transport_add_ref(transport);
+	sip_transport = transport;
+	test->tls_connection = acc->config->tlsConnectionUsed(transport) ? "reused" : "new";
+}
+
+void TestCall::schedule_timer(int msec) {
+	cancel_timer();
+	pj_time_val delay = {msec / 1000, msec % 1000};
+	pjsua_schedule_timer(&timer, &delay);
+}
+
+void TestCall::cancel_timer() {
+	pjsua_cancel_timer(&timer);
+}
+
+void TestCall::on_timer(pj_timer_heap_t *timer_heap, pj_timer_entry *entry) {
+	PJ_UNUSED_ARG(timer_heap);
+	TestCall *call = (TestCall *) entry->user_data;
+	call->handle_timer();
+}
+
+void TestCall::handle_timer() {
+	if (!test || test->state == VPT_DONE)
+		return;
+	CallInfo ci = getInfo();
+	if (ci.state == PJSIP_INV_STATE_CONFIRMED) {
+		test->connect_duration = ci.connectDuration.sec;
+		test->setup_duration = ci.totalDuration.sec - ci.connectDuration.sec;
+		test->result_cause_code = (int)ci.lastStatusCode;
+		test->reason = ci.lastReason;
+		LOG(logINFO) <<__FUNCTION__<<": [hangup:call]["<<getId()<<"]["<<ci.callIdString<<"] after "<<test->hangup_duration<<"s";
+		// the result is written first, the call can be released as soon as it is hung up
+		collect_detection();
+		test->update_result();
+		CallOpParam prm(true);
+		try {
+			hangup(prm);
+		} catch (pj::Error e)  {
+			if (e.status != 171140) LOG(logERROR) <<__FUNCTION__<<" error :" << e.status;
+		}
+		return;
+	} else if (ci.state == PJSIP_INV_STATE_INCOMING || ci.state == PJSIP_INV_STATE_EARLY) {
+		if (ci.role == PJSIP_ROLE_UAS && test->ring_duration > 0) {
+			LOG(logINFO) <<__FUNCTION__<<": [answer:call]["<<getId()<<"]["<<ci.callIdString<<"] after "<<test->ring_duration<<"s";
+			CallOpParam prm;
+			if (test->reason.size() > 0) prm.reason = test->reason;
+			if (test->code) prm.statusCode = test->code;
+			answer(prm);
+			return;
+		}
+	}
+	if (ci.role == PJSIP_ROLE_UAC && (ci.state == PJSIP_INV_STATE_CALLING || ci.state == PJSIP_INV_STATE_EARLY)) {
+		LOG(logINFO) <<__FUNCTION__<<": [cancelling:call]["<<getId()<<"]["<<ci.callIdString<<"]["<<ci.remoteUri<<"]["
+		             <<ci.stateText<<"] after "<<test->max_calling_duration<<"s";
+		CallOpParam prm(true);
+		try {
+			hangup(prm);
+		} catch (pj::Error e)  {
+			if (e.status != 171140) LOG(logERROR) <<__FUNCTION__<<" error :" << e.status;
+		}
+	}
+}
+
+void TestCall::schedule_rtp_sampler() {
+	int msec = test->rtp_stats_interval;
+	pj_time_val delay = {msec / 1000, msec % 1000};
+	pjsua_schedule_timer(&rtp_sampler, &delay);
+}
+
+void TestCall::on_rtp_sampler(pj_timer_heap_t *timer_heap, pj_timer_entry *entry) {
+	PJ_UNUSED_ARG(timer_heap);
+	TestCall *call = (TestCall *) entry->user_data;
+	if (!call->test || call->test->state == VPT_DONE || call->disconnected)
+		return;
+	call->sample_rtp_stats();
+	call->schedule_rtp_sampler();
+}
+
+void TestCall::sample_rtp_stats() {
+	// the C API fills a plain struct, cheap enough to run on every call every second
+	pjsua_stream_stat stat;
+	if (pjsua_call_get_stream_stat(getId(), 0, &stat) != PJ_SUCCESS)
+		return;
+	const pjmedia_rtcp_stat &rtcp = stat.rtcp;
+	RtpSample sample;
+	sample.rx_pkt = rtcp.rx.pkt - rtp_totals.rx_pkt;
+	sample.rx_loss = rtcp.rx.loss - rtp_totals.rx_loss;
+	sample.rx_discard = rtcp.rx.discard - rtp_totals.rx_discard;
+	sample.tx_pkt = rtcp.tx.pkt - rtp_totals.tx_pkt;
+	sample.tx_loss = rtcp.tx.loss - rtp_totals.tx_loss;
+	sample.rx_jitter_ms = rtcp.rx.jitter.last / 1000;
+	sample.rtt_ms = rtcp.rtt.last / 1000;
+	rtp_totals.rx_pkt = rtcp.rx.pkt;
+	rtp_totals.rx_loss = rtcp.rx.loss;
+	rtp_totals.rx_discard = rtcp.rx.discard;
+	rtp_totals.tx_pkt = rtcp.tx.pkt;
+	rtp_totals.tx_loss = rtcp.tx.loss;
+	test->rtp_series.push_back(sample);
+}
+
+void TestCall::collect_detection() {
+	if (!test || !capture || !test->detects())
+		return;
+	test->detection = capture->detection();
+	test->detection_ready = true;
+}
+
+void TestCall::release_generator() {
+	CallGenerator *call_generator = generator.exchange(nullptr);
+	if (call_generator)
+		call_generator->call_ended();
+}
+
 
 void TestCall::onCallRxOffer(OnCallTsxStateParam &prm) {
 	PJ_UNUSED_ARG(prm);
@@ -80,10 +245,28 @@ void TestCall::onCallRxOffer(OnCallTsxStateParam &prm) {
 }
 
 void TestCall::onCallTsxState(OnCallTsxStateParam &prm) {
-	PJ_UNUSED_ARG(prm);
 	CallInfo ci = getInfo();
 	LOG(logINFO) <<__FUNCTION__<<": ["<<getId()<<"]["<<ci.remoteUri<<"]["<<ci.stateText<<"]id["<<ci.callIdString<<"]";
 	// if (ci.stateText.compare("INCOMING")  == 0 ) pj_thread_sleep(10000);
+	if (!test || prm.e.type != PJSIP_EVENT_TSX_STATE)
+		return;
+	// the responses received by a call, or sent by an accept
+	const TsxStateEvent &tsx_state = prm.e.body.tsxState;
+	if (tsx_state.tsx.method != "INVITE")
+		return;
+	bool uac = tsx_state.tsx.role == PJSIP_ROLE_UAC;
+	int code = tsx_state.tsx.statusCode;
+	if (uac && tsx_state.type == PJSIP_EVENT_TX_MSG && tsx_state.tsx.state == PJSIP_TSX_STATE_CALLING) {
+		test->stage_reached(VPS_INVITE);
+	} else if (tsx_state.type == (uac ? PJSIP_EVENT_RX_MSG : PJSIP_EVENT_TX_MSG)) {
+		// an accept starts its clock in onIncomingCall, after pjsua sent the 100
+		if (code == 100 && uac)
+			test->stage_reached(VPS_100);
+		else if (code >= 180 && code < 190)
+			test->stage_reached(VPS_18X);
+		else if (code >= 200 && code < 300)
+			test->stage_reached(VPS_200);
+	}
 }
 
 /* Convenient function to convert transmission factor to MOS */
@@ -104,12 +287,28 @@ void TestCall::onDtmfDigit(OnDtmfDigitParam &prm) {
 	test->dtmf_recv.append(prm.digit);
 }
 
+// --pcap: the audio of the call goes through the capture adapter
+void TestCall::onCreateMediaTransport(OnCreateMediaTransportParam &prm) {
+	PacketCapture *packet_capture = acc->config->packet_capture;
+	if (!packet_capture || !packet_capture->is_running() || prm.mediaIdx != 0)
+		return;
+	prm.mediaTp = packet_capture->wrap_media((pjmedia_transport *) prm.mediaTp, prm.flags & PJSUA_MED_TP_CLOSE_MEMBER, &capture_key);
+}
+
 void TestCall::onStreamDestroyed(OnStreamDestroyedParam &prm) {
 	LOG(logDEBUG) <<__FUNCTION__<<": idx["<<prm.streamIdx<<"]";
-	pjmedia_stream const *pj_stream = (pjmedia_stream *)&prm.stream;
-	pjmedia_stream_info *pj_stream_info;
+	// pjsua removed the null port from the bridge (pjsua_conf_remove_port) before this callback
+	release_media();
+	if (!test || test->rtp_stats_ready)
+		return;
+	get_rtp_stats(prm.streamIdx);
+	if (test->queued)
+		test->update_result();
+}
+
+void TestCall::get_rtp_stats(unsigned stream_idx) {
 	try {
-		StreamStat const &stats = getStreamStat(prm.streamIdx);
+		StreamStat const &stats = getStreamStat(stream_idx);
 		RtcpStat rtcp = stats.rtcp;
 		RtcpStreamStat rxStat = rtcp.rxStat;
 		RtcpStreamStat txStat = rtcp.txStat;
@@ -137,58 +336,141 @@ void TestCall::onStreamDestroyed(OnStreamDestroyedParam &prm) {
 
 		LOG(logINFO) << __FUNCTION__ <<" rtt:"<< rtcp.rttUsec.mean/1000 <<" mos_lq_tx:"<<mos_tx<<" mos_lq_rx:"<<mos_rx;
 		rtt = rtcp.rttUsec.mean/1000;
-		test->rtp_stats_json = " \"rtp_stats\":{\"rtt\":"+to_string(rtt)+","
-						"\"Tx\":{"
-							"\"jitter_avg\": "+to_string(txStat.jitterUsec.mean/1000)+", "
-							"\"jitter_max\": "+to_string(txStat.jitterUsec.max/1000)+", "
-							"\"pkt\": "+to_string(txStat.pkt)+", "
-							"\"kbytes\": "+to_string(txStat.bytes/1024)+", "
-							"\"loss\": "+to_string(txStat.loss)+", "
-							"\"discard\": "+to_string(txStat.discard)+", "
-							"\"mos_lq\": "+to_string(mos_tx)+"} "
-						", \"Rx\":{"
-							"\"jitter_avg\": "+to_string(rxStat.jitterUsec.mean/1000)+", "
-							"\"jitter_max\": "+to_string(rxStat.jitterUsec.max/1000)+", "
-							"\"pkt\": "+to_string(rxStat.pkt)+", "
-							"\"kbytes\": "+to_string(rxStat.bytes/1024)+", "
-							"\"loss\": "+to_string(rxStat.loss)+", "
-							"\"discard\": "+to_string(rxStat.discard)+", "
-							"\"mos_lq\": "+to_string(mos_rx)+"} "
-						"}";
+		static thread_local JsonWriter json(512);
+		json.clear();
+		json.begin_object();
+		json.add("rtt", rtt);
+		json.begin_object("Tx");
+		json.add("jitter_avg", txStat.jitterUsec.mean/1000);
+		json.add("jitter_max", txStat.jitterUsec.max/1000);
+		json.add("pkt", txStat.pkt);
+		json.add("kbytes", txStat.bytes/1024);
+		json.add("loss", txStat.loss);
+		json.add("discard", txStat.discard);
+		json.add("mos_lq", mos_tx);
+		json.end_object();
+		json.begin_object("Rx");
+		json.add("jitter_avg", rxStat.jitterUsec.mean/1000);
+		json.add("jitter_max", rxStat.jitterUsec.max/1000);
+		json.add("pkt", rxStat.pkt);
+		json.add("kbytes", rxStat.bytes/1024);
+		json.add("loss", rxStat.loss);
+		json.add("discard", rxStat.discard);
+		json.add("mos_lq", mos_rx);
+		json.end_object();
+		json.end_object();
+		test->rtp_stats_json = json.str();
 		test->rtp_stats_ready = true;
 	} catch (pj::Error e)  {
 			LOG(logERROR) <<__FUNCTION__<<" error :" << e.status << std::endl;
 	}
 }
 
+void TestCall::onCallSdpCreated(OnCallSdpCreatedParam &prm) {
+	if (!test || test->codecs.empty())
+		return;
+	// the SDP is changed in place, pjsua2 only parses it again when wholeSdp was changed
+	pjmedia_sdp_session *sdp = (pjmedia_sdp_session *)prm.sdp.pjSdpSession;
+	if (!sdp || !sdp_filter_codecs(sdp, test->codecs)) {
+		LOG(logINFO) <<__FUNCTION__<<": ["<<getId()<<"] none of the codecs found in the SDP";
+	}
+}
+
+// the answer to a new call is created before the call object and its onCallSdpCreated,
+// it is filtered in the negotiator, before the call is answered
+void TestCall::filter_answer_codecs(pjsip_rx_data *rdata) {
+	if (!test || test->codecs.empty())
+		return;
+	pjsip_dialog *dlg = pjsip_rdata_get_dlg(rdata);
+	if (!dlg && pjsip_rdata_get_tsx(rdata))
+		dlg = pjsip_tsx_get_dlg(pjsip_rdata_get_tsx(rdata));
+	pjsip_inv_session *inv = dlg ? pjsip_dlg_get_inv_session(dlg) : nullptr;
+	const pjmedia_sdp_session *answer = nullptr;
+	if (!inv || !inv->neg || pjmedia_sdp_neg_get_state(inv->neg) != PJMEDIA_SDP_NEG_STATE_WAIT_NEGO ||
+	    pjmedia_sdp_neg_get_neg_local(inv->neg, &answer) != PJ_SUCCESS || !answer) {
+		LOG(logINFO) <<__FUNCTION__<<": ["<<getId()<<"] no local answer, codecs not applied";
+		return;
+	}
+	// the answer sent is negotiated from this SDP
+	if (!sdp_filter_codecs((pjmedia_sdp_session *)answer, test->codecs)) {
+		LOG(logINFO) <<__FUNCTION__<<": ["<<getId()<<"] none of the codecs found in the SDP";
+	}
+}
+
 void TestCall::onStreamCreated(OnStreamCreatedParam &prm) {
 	LOG(logDEBUG) <<__FUNCTION__<< " idx["<<prm.streamIdx<<"]\n";
-	//pjmedia_stream const *pj_stream = (pjmedia_stream *)&prm.stream;
-	//pjmedia_stream_info *pj_stream_info;
-	//pjmedia_stream_get_info(pj_stream, pj_stream_info);
+	Config *config = acc->config;
+	if (!test || !config->media_pump.is_running())
+		return;
+	pjmedia_port *stream = (pjmedia_port *)prm.pPort;
+	if (PJMEDIA_PIA_CCNT(&stream->info) != 1) {
+		LOG(logINFO) <<__FUNCTION__<<": ["<<getId()<<"] multichannel stream left on the bridge";
+		return;
+	}
+	// an updated offer re-creates the stream
+	release_media();
+	MediaLink *link = new MediaLink(stream);
+	if (!link->init()) {
+		LOG(logERROR) <<__FUNCTION__<<": ["<<getId()<<"] can not create media link";
+		delete link;
+		return;
+	}
+	unsigned clock_rate = PJMEDIA_PIA_SRATE(&stream->info);
+	unsigned samples_per_frame = PJMEDIA_PIA_SPF(&stream->info);
+	std::shared_ptr<const AudioClip> clip = config->playback_cache.get(test->play, clock_rate);
+	if (clip)
+		link->source = new PlaybackPort(clip, samples_per_frame);
+	if (test->listens()) {
+		// kept across a re-created stream
+		if (!capture)
+			capture = create_capture(test, config, clock_rate, samples_per_frame);
+		link->sink = capture->get_port();
+	}
+	prm.pPort = link->null_port;
+	media_link = link;
+	config->media_pump.add(link);
 }
 
-static pj_status_t record_call(TestCall* call, pjsua_call_id call_id, const char *caller_contact) {
-	pj_status_t status = PJ_SUCCESS;
-	pjsua_recorder_id recorder_id;
-	char rec_fn[1024] = "voice_ref_files/recording.wav";
-	CallInfo ci = call->getInfo();
-	sprintf(rec_fn,"voice_files/%s_%s_rec.wav", ci.callIdString.c_str(), caller_contact);
-	call->test->record_fn = string(&rec_fn[0]);
-	const pj_str_t rec_file_name = pj_str(rec_fn);
-	status = pjsua_recorder_create(&rec_file_name, 0, NULL, -1, 0, &recorder_id);
+void TestCall::release_media() {
+	if (!media_link)
+		return;
+	acc->config->media_pump.release(media_link);
+	media_link = nullptr;
+}
+
+static pj_status_t capture_call(TestCall* call, pjsua_call_id call_id) {
+	if (call->capture)
+		return PJ_SUCCESS;
+	Test *test = call->test;
+	// captured at the scoring rate when it is scored, the bridge resamples
+	unsigned clock_rate = test->min_mos > 0 ? MOS_CLOCK_RATE : call->get_account()->config->confClockRate();
+	call->capture = create_capture(test, call->get_account()->config, clock_rate, clock_rate * VP_MEDIA_PTIME / 1000);
+	pj_status_t status = call->capture->connect(pjsua_call_get_conf_port(call_id));
 	if (status != PJ_SUCCESS) {
-		LOG(logINFO) <<__FUNCTION__<<": [error] tecord_call \n";
-		return status;
+		LOG(logERROR) <<__FUNCTION__<<": [error] capture_call ["<<status<<"]";
 	}
-	call->recorder_id = recorder_id;
-	LOG(logINFO) <<__FUNCTION__<<": [recorder] created:" << recorder_id << " fn:"<< rec_fn;
-	status = pjsua_conf_connect( pjsua_call_get_conf_port(call_id), pjsua_recorder_get_conf_port(recorder_id) );
+	return status;
 }
 
 static pj_status_t stream_to_call(TestCall* call, pjsua_call_id call_id, const char *caller_contact ) {
 	pj_status_t status = PJ_SUCCESS;
 	pjsua_player_id player_id;
+	Config *config = call->get_account()->config;
+	// made once at the bridge clock rate, the bridge does not resample it for every call
+	unsigned clock_rate = config->confClockRate();
+	std::shared_ptr<const AudioClip> clip = config->playback_cache.get(call->test->play, clock_rate);
+	if (clip) {
+		unsigned ptime = config->media_cfg.ptime ? config->media_cfg.ptime : VP_MEDIA_PTIME;
+		call->playback = new PlaybackPort(clip, clock_rate * ptime / 1000);
+		status = call->playback->connect(pjsua_call_get_conf_port(call_id));
+		if (status != PJ_SUCCESS) {
+			LOG(logINFO) <<__FUNCTION__<<": [error] connecting playback\n";
+		}
+		return status;
+	}
+	if (is_synthetic_clip(call->test->play))
+		return PJ_EINVAL;
+	// not a format the cache can decode, pjmedia may still play it
 	char * fn = new char [call->test->play.length()+1];
 	strcpy (fn, call->test->play.c_str());
 	const pj_str_t file_name = pj_str(fn);
@@ -219,14 +501,13 @@ void TestCall::onCallState(OnCallStateParam &prm) {
 	if (pos!=std::string::npos) {
 		local_user = ci.localUri.substr(uri_prefix, pos - uri_prefix);
 	}
-	pos = ci.remoteUri.find("@");
-	uri_prefix = 3;
-	if (ci.remoteUri[0] != '<')
-		uri_prefix++;
-	if (pos!=std::string::npos) {
-		remote_user = ci.remoteUri.substr(uri_prefix, pos - uri_prefix);
-	}
+	remote_user = remote_user_from_uri(ci.remoteUri);
 	role = ci.role;
+	// the media transport may be closed once the call is disconnected
+	if (capture_key && ci.state == PJSIP_INV_STATE_DISCONNECTED)
+		capture_key = nullptr;
+	else if (capture_key)
+		capture_key->store(PacketCapture::call_key(ci.callIdString), std::memory_order_relaxed);
 
 	if (test) {
 		pjsip_tx_data *pjsip_data = (pjsip_tx_data *) prm.e.body.txMsg.tdata.pjTxData;
@@ -234,15 +515,28 @@ void TestCall::onCallState(OnCallStateParam &prm) {
 			test->transport = pjsip_data->tp_info.transport->type_name;
 			test->peer_socket = pjsip_data->tp_info.dst_name;
 			test->peer_socket = test->peer_socket +":"+ std::to_string(pjsip_data->tp_info.dst_port);
+			track_transport(pjsip_data->tp_info.transport);
 		}
 		if (test->state != VPT_DONE && test->wait_state && (int)test->wait_state <= (int)ci.state ) {
-			test->state = VPT_RUN;
+			test->set_state(VPT_RUN);
 			LOG(logDEBUG) <<__FUNCTION__<<": [test-wait-return]";
 		}
 		LOG(logINFO) <<__FUNCTION__<<": ["<<getId()<<"]role["<<(ci.role==0?"CALLER":"CALLEE")<<"]id["<<ci.callIdString
                              <<"]["<<ci.localUri<<"]["<<ci.remoteUri<<"]["<< ci.stateText<<"|"<<ci.state<<"]";
 		test->call_id = getId();
 		test->sip_call_id = ci.callIdString;
+		if (ci.state == PJSIP_INV_STATE_CONFIRMED)
+			test->stage_reached(VPS_ACK);
+		if (ci.state == PJSIP_INV_STATE_CALLING && test->max_calling_duration)
+			schedule_timer(test->max_calling_duration * 1000);
+		else if (ci.state == PJSIP_INV_STATE_CONFIRMED && test->hangup_duration)
+			schedule_timer(test->hangup_duration * 1000);
+		else if (ci.state == PJSIP_INV_STATE_CONFIRMED || ci.state == PJSIP_INV_STATE_DISCONNECTED)
+			cancel_timer();
+		if (ci.state == PJSIP_INV_STATE_CONFIRMED && test->rtp_stats_interval > 0)
+			schedule_rtp_sampler();
+		else if (ci.state == PJSIP_INV_STATE_DISCONNECTED)
+			pjsua_cancel_timer(&rtp_sampler);
 	}
 	if (test && (ci.state == PJSIP_INV_STATE_DISCONNECTED || ci.state == PJSIP_INV_STATE_CONFIRMED)) {
 		std::string res = "call[" + std::to_string(ci.lastStatusCode) + "] reason["+ ci.lastReason +"]";
@@ -250,17 +544,6 @@ void TestCall::onCallState(OnCallStateParam &prm) {
 		test->setup_duration = ci.totalDuration.sec - ci.connectDuration.sec;
 		test->result_cause_code = (int)ci.lastStatusCode;
 		test->reason = ci.lastReason;
-		if (ci.state == PJSIP_INV_STATE_DISCONNECTED || (test->hangup_duration && ci.connectDuration.sec >= test->hangup_duration) ){
-			if (test->state != VPT_DONE) {
-				test->update_result();
-			}
-			if (ci.state == PJSIP_INV_STATE_CONFIRMED){
-				CallOpParam prm(true);
-				LOG(logINFO) <<__FUNCTION__<<": hangup : call in PJSIP_INV_STATE_CONFIRMED" ;
-				hangup(prm);
-				LOG(logINFO) <<__FUNCTION__<<": hangup ok";
-			}
-		}
 	}
 	// Create player and recorder
 	if (ci.state == PJSIP_INV_STATE_CONFIRMED){
@@ -268,9 +551,12 @@ void TestCall::onCallState(OnCallStateParam &prm) {
 			dialDtmf(test->play_dtmf);
 			LOG(logINFO) <<__FUNCTION__<<": [dtmf]" << test->play_dtmf;
 		}
-		stream_to_call(this, ci.id, remote_user.c_str());
-		if (test->min_mos)
-			record_call(this, ci.id, remote_user.c_str());
+		// without the bridge the media pump already plays and captures the call
+		if (!media_link) {
+			stream_to_call(this, ci.id, remote_user.c_str());
+			if (test->listens())
+				capture_call(this, ci.id);
+		}
 	}
 	if (ci.state == PJSIP_INV_STATE_DISCONNECTED) {
 		LOG(logINFO) <<__FUNCTION__<<": [Call disconnected]";
@@ -278,10 +564,61 @@ void TestCall::onCallState(OnCallStateParam &prm) {
 			pjsua_player_destroy(player_id);
 			player_id = -1;
 		}
-		if (recorder_id != -1){
-			pjsua_recorder_destroy(recorder_id);
-			recorder_id = -1;
+		if (playback) {
+			delete playback;
+			playback = nullptr;
 		}
+		release_media();
+		if (sip_transport) {
+			// the next call makes a new connection, and a full handshake
+			if (test && test->tls_no_reuse)
+				pjsip_transport_shutdown(sip_transport);
+			pjsip_transport_dec_ref(sip_transport);
+			sip_transport = nullptr;
+		}
+		if (capture) {
+			collect_detection();
+			std::shared_ptr<AudioClip> clip = capture->take();
+			delete capture;
+			capture = nullptr;
+			if (test && test->min_mos > 0)
+				test->capture = clip;
+			if (test && test->recording) {
+				set_record_fn(this, ci, remote_user.c_str());
+				// only written when asked, on the worker pool
+				std::string fn = test->record_fn;
+				acc->config->mos_pool.submit([clip, fn]() {
+					if (write_wav_clip(*clip, fn)) {
+						LOG(logINFO) <<"write_wav_clip: [recording] "<<fn;
+					}
+				});
+			}
+		}
+		release_generator();
+		disconnected = true;
+		if (test) {
+			// the stream is still there, the stats are collected now in case it was not destroyed yet
+			if (test->rtp_stats && !test->rtp_stats_ready) {
+				get_rtp_stats(0);
+				if (!test->rtp_stats_ready)
+					test->rtp_stats = false;
+			}
+			if (test->min_mos > 0 && !test->mos_ready && test->state != VPT_DONE) {
+				// scored on the worker pool, the test outlives the call
+				Test *scored = test;
+				test = nullptr;
+				acc->config->mos_pool.submit([scored]() {
+					scored->get_mos();
+					scored->update_result();
+					delete scored;
+				});
+			} else if (test->state != VPT_DONE || test->queued) {
+				test->update_result();
+			}
+		}
+		// the result is written, the call and its test are released
+		if (!making_call)
+			acc->config->removeCall(this);
 	}
 }
 
@@ -291,6 +628,8 @@ void TestCall::onCallState(OnCallStateParam &prm) {
  */
 
 void TestAccount::setTest(Test *ptest) {
+	if (test)
+		delete test; // replaced before the registration completed
 	test = ptest;
 }
 
@@ -300,10 +639,25 @@ TestAccount::TestAccount() {
 	hangup_duration=0;
 	max_duration=0;
 	ring_duration=0;
+	rtp_stats=false;
+	rtp_stats_interval=0;
+	recording=false;
+	min_mos=0.0;
+	tls_no_reuse=false;
 	accept_label="-";
 	expected_cause_code=200;
 }
 
+void TestAccount::removeCall(Call *call) {
+	for (auto it = calls.begin(); it != calls.end(); ++it) {
+		if (*it == call) {
+			*it = calls.back();
+			calls.pop_back();
+			break;
+		}
+	}
+}
+
 TestAccount::~TestAccount() {
 	LOG(logINFO) << "[Account] is being deleted: No of calls=" << calls.size() ;
 }
@@ -315,11 +669,32 @@ void TestAccount::onRegState(OnRegStateParam &prm) {
 		if ( prm.rdata.pjRxData && prm.code != 408 && prm.code != PJSIP_SC_SERVICE_UNAVAILABLE) {
 			pjsip_rx_data *pjsip_data = (pjsip_rx_data *) prm.rdata.pjRxData;
 			test->transport = pjsip_data->tp_info.transport->type_name;
+			if (pjsip_data->tp_info.transport->flag & PJSIP_TRANSPORT_SECURE)
+				test->tls_connection = config->tlsConnectionUsed(pjsip_data->tp_info.transport) ? "reused" : "new";
 		}
 		std::string res = "registration[" + std::to_string(prm.code) + "] reason["+ prm.reason + "] expiration[" + std::to_string(prm.expiration) +"]";
+		if (test->register_generator)
+			test->register_generator->registered((int)prm.code, test->register_ns);
 		test->result_cause_code = (int)prm.code;
 		test->reason = prm.reason;
 		test->update_result();
+		delete test;
+		test = NULL;
+	} else if (prm.code / 100 != 2 || !ai.regIsActive) {
+		// a refresh failed, or the account was unregistered (not a refresh)
+		if (prm.code / 100 != 2)
+			config->register_refresh_failures++;
+	} else {
+		// refreshed by pjsua
+		WorkerCounters *counters = config->counters();
+		if (counters)
+			counters->refreshes++;
+		double mean;
+		unsigned long peak;
+		if (config->register_refreshes.add(&mean, &peak)) {
+			LOG(logINFO) <<__FUNCTION__<<": [register] refreshes["<<config->register_refreshes.count()<<"] per second mean["
+			             <<mean<<"] peak["<<peak<<"] failed["<<config->register_refresh_failures<<"]";
+		}
 	}
 }
 
@@ -342,21 +717,29 @@ void TestAccount::onIncomingCall(OnIncomingCallParam &iprm) {
 		call->test->local_user = ci.localUri;
 		call->test->remote_user = ci.remoteUri;
 		call->test->label = accept_label;
+		call->test->stage_reached(VPS_INVITE);
 		call->test->sip_call_id = ci.callIdString;
 		call->test->transport = pjsip_data->tp_info.transport->type_name;
 		call->test->peer_socket = iprm.rdata.srcAddress;
-		call->test->state = VPT_RUN;
 		call->test->rtp_stats = rtp_stats;
+		call->test->rtp_stats_interval = rtp_stats_interval;
+		call->test->detect_tones = detect_tones;
+		call->test->detect_dtmf = detect_dtmf;
+		call->test->codecs = codecs;
+		call->test->tls_no_reuse = tls_no_reuse;
+		call->test->recording = recording;
+		call->test->min_mos = min_mos;
 		call->test->code = (pjsip_status_code) code;
 		call->test->reason = reason;
 		if (wait_state != INV_STATE_NULL)
-			call->test->state = VPT_RUN_WAIT;
+			call->test->set_state(VPT_RUN_WAIT);
 		LOG(logINFO) <<__FUNCTION__<<"account play:" << play;
 		call->test->play = play;
 		call->test->play_dtmf = play_dtmf;
+		call->track_transport(pjsip_data->tp_info.transport);
+		call->filter_answer_codecs(pjsip_data);
 	}
-	calls.push_back(call);
-	config->calls.push_back(call);
+	config->addCall(this, call);
 	LOG(logINFO) <<__FUNCTION__<<"code:" << code <<" reason:"<< reason;
 	prm.statusCode = PJSIP_SC_OK;
 	if (ring_duration > 0) {
@@ -366,6 +749,8 @@ void TestAccount::onIncomingCall(OnIncomingCallParam &iprm) {
 		if (code) prm.statusCode = (pjsip_status_code) code;
 	}
 	call->answer(prm);
+	if (ring_duration > 0)
+		call->schedule_timer(ring_duration * 1000);
 }
 
 
@@ -376,6 +761,9 @@ void TestAccount::onIncomingCall(OnIncomingCallParam &iprm) {
 Test::Test(Config *config, string type) : config(config), type(type) {
 	char now[20] = {'\0'};
 	get_time_string(now);
+	start_ms = clock_wall_ms();
+	end_ms = 0;
+	answer_ms = 0;
 	from="";
 	to="";
 	wait_state = INV_STATE_NULL;
@@ -383,6 +771,8 @@ Test::Test(Config *config, string type) : config(config), type(type) {
 	start_time = now;
 	min_mos = 0.0;
 	mos = 0.0;
+	mos_ready = false;
+	reference_fn = "voice_ref_files/reference_8000_12s.wav";
 	expected_cause_code = -1;
 	result_cause_code = -1;
 	reason = "";
@@ -399,25 +789,94 @@ Test::Test(Config *config, string type) : config(config), type(type) {
 	playing=false;
 	rtp_stats_ready=false;
 	rtp_stats=false;
+	rtp_stats_interval=0;
+	tls_no_reuse=false;
+	register_generator=nullptr;
+	register_ns=0;
+	invite_ns=0;
+	for (int i = 0; i < VPS_COUNT; i++)
+		stage_us[i] = -1;
+	detection_ready=false;
 	queued=false;
+	config->addTest(this);
 	LOG(logINFO)<<__FUNCTION__<<LOG_COLOR_INFO<<": New test created:"<<type<<LOG_COLOR_END;
 }
 
+Test::~Test() {
+	config->removeTest(this);
+}
+
+const char *call_stage_names[VPS_COUNT] = {"invite", "100", "18x", "200", "ack"};
+
+// only the first time a stage is reached counts, the INVITE starts the clock
+void Test::stage_reached(call_stage_t stage) {
+	uint64_t now = clock_mono_ns();
+	if (stage == VPS_INVITE) {
+		if (stage_us[VPS_INVITE] < 0) {
+			invite_ns = now;
+			stage_us[VPS_INVITE] = 0;
+		}
+		return;
+	}
+	if (stage == VPS_200 && answer_ms == 0)
+		answer_ms = clock_wall_ms();
+	if (stage_us[VPS_INVITE] < 0 || stage_us[stage] >= 0)
+		return;
+	stage_us[stage] = (now - invite_ns) / 1000;
+}
+
+void Test::set_state(test_state_t new_state) {
+	config->setTestState(this, new_state);
+}
+
 void Test::get_mos() {
-	std::string reference = "voice_ref_files/reference_8000_12s.wav";
-	std::string degraded = "voice_files/" + remote_user + "_rec.wav";
-	LOG(logINFO)<<__FUNCTION__<<": [call] mos["<<mos<<"] min-mos["<<min_mos<<"] "<< reference <<" vs "<< record_fn;
+	mos_ready = true;
+	std::shared_ptr<const AudioClip> reference = config->playback_cache.get(reference_fn, MOS_CLOCK_RATE);
+	std::shared_ptr<AudioClip> degraded = capture;
+	capture = nullptr;
+	if (!reference || !degraded || degraded->samples.empty()) {
+		LOG(logERROR)<<__FUNCTION__<<": [call] can not load "<< reference_fn <<" or no audio captured";
+		return;
+	}
+	if (degraded->clock_rate != MOS_CLOCK_RATE)
+		degraded = resample_clip(*degraded, MOS_CLOCK_RATE);
+	MosScore score = mos_score(*reference, *degraded);
+	mos = score.mos;
+	LOG(logINFO)<<__FUNCTION__<<": [call] mos["<<mos<<"] min-mos["<<min_mos<<"] delay["<<score.delay_ms<<"ms] disturbance["
+	            <<score.disturbance<<"] correlation["<<score.correlation<<"] "<< reference_fn <<" vs capture["
+	            <<degraded->samples.size() / MOS_CLOCK_RATE<<"s]"
+	            <<(score.error.empty() ? "" : " error: ")<<score.error;
 }
 
-void jsonify(std::string *str) {
-	size_t index = 0;
-	while (true) {
-		index = str->find("\"", index);
-		if (index == std::string::npos) break;
-		std::cout << str->substr(index)  << std::endl;
-		str->replace(index, 1, "\\\"");
-		index += 2;
+bool Test::check_detection() {
+	if (!detects())
+		return true;
+	if (!detection_ready)
+		return false;
+	for (unsigned freq : detect_tones) {
+		bool found = false;
+		for (const ToneReport::Tone &tone : detection.tones) {
+			if (tone.freq == freq && tone.first_ms >= 0)
+				found = true;
+		}
+		if (!found) {
+			LOG(logINFO)<<__FUNCTION__<<": [call] tone["<<freq<<"] not detected";
+			return false;
+		}
+	}
+	if (!detect_dtmf.empty() && detection.dtmf().find(detect_dtmf) == std::string::npos) {
+		LOG(logINFO)<<__FUNCTION__<<": [call] dtmf["<<detect_dtmf<<"] not detected in ["<<detection.dtmf()<<"]";
+		return false;
 	}
+	return true;
+}
+
+// one array per counter, the samples are in time order
+static void add_rtp_series(JsonWriter &json, const char *key, const std::vector<RtpSample> &series, unsigned RtpSample::*counter) {
+	json.begin_array(key);
+	for (const RtpSample &sample : series)
+		json.add_value((long long)(sample.*counter));
+	json.end_array();
 }
 
 void Test::update_result() {
@@ -425,66 +884,119 @@ void Test::update_result() {
 		bool success = false;
 		get_time_string(now);
 		end_time = now;
-		state = VPT_DONE;
-		std::string res = "FAIL";
-
-		if (min_mos > 0 && mos == 0) {
+		end_ms = clock_wall_ms();
+		// the test is still running until the recording is scored
+		if (min_mos > 0 && !mos_ready) {
 				return;
 		}
+		set_state(VPT_DONE);
+		std::string res = "FAIL";
+
 		if (rtp_stats && !rtp_stats_ready) {
 			LOG(logINFO)<<__FUNCTION__<<" push_back rtp_stats";
-			if (queued) return;
 			queued = true;
-			config->tests_with_rtp_stats.push_back(this);
 			return;
 		}
+		queued = false;
 
 		if (expected_duration && expected_duration != connect_duration) {
 			success=false;
 		} else if (max_duration && max_duration < connect_duration) {
 			success=false;
-		} else if(expected_cause_code == result_cause_code && mos >= min_mos) {
+		} else if(expected_cause_code == result_cause_code && mos >= min_mos && check_detection()) {
 			res = "PASS";
 			success=true;
 		}
 
-		// JSON report
-		string jsonFrom = local_user;
-		jsonify(&jsonFrom);
-		string jsonTo = remote_user;
-		jsonify(&jsonTo);
-		string jsonCallid = sip_call_id;
-		jsonify(&jsonCallid);
-		string jsonReason = reason;
-		jsonify(&jsonReason);
-
-		config->json_result_count++;
-		std::string result_line_json = "{\""+std::to_string(config->json_result_count)+"\": {"
-							"\"label\": \""+label+"\", "
-							"\"start\": \""+start_time+"\", "
-							"\"end\": \""+end_time+"\", "
-							"\"action\": \""+type+"\", "
-							"\"from\": \""+jsonFrom+"\", "
-							"\"to\": \""+jsonTo+"\", "
-							"\"result\": \""+res+"\", "
-							"\"expected_cause_code\": "+std::to_string(expected_cause_code)+", "
-							"\"cause_code\": "+std::to_string(result_cause_code)+", "
-							"\"reason\": \""+jsonReason+"\", "
-							"\"callid\": \""+jsonCallid+"\", "
-							"\"transport\": \""+transport+"\", "
-							"\"peer_socket\": \""+peer_socket+"\", "
-							"\"duration\": "+std::to_string(connect_duration)+", "
-							"\"expected_duration\": "+std::to_string(expected_duration)+", "
-							"\"max_duration\": "+std::to_string(max_duration)+", "
-							"\"hangup_duration\": "+std::to_string(hangup_duration);
+		if (type.compare("call") == 0 || type.compare("accept") == 0) {
+			config->media_call_seconds += connect_duration;
+			if (config->packet_capture)
+				config->packet_capture->call_result(sip_call_id, success);
+			if (stage_us[VPS_INVITE] == 0)
+				config->recordStages(label, stage_us);
+		}
+
+		WorkerCounters *counters = config->counters();
+		if (counters) {
+			counters->results++;
+			if (success)
+				counters->passed++;
+			else
+				counters->failed++;
+		}
+
+		// JSON report, the result file adds the key
+		static thread_local JsonWriter json;
+		json.clear();
+		json.begin_object();
+		json.add("label", label);
+		json.add("start", start_time);
+		json.add("end", end_time);
+		json.add("start_ms", (unsigned long long)start_ms);
+		json.add("end_ms", (unsigned long long)end_ms);
+		if (answer_ms)
+			json.add("answer_ms", (unsigned long long)answer_ms);
+		json.add("action", type);
+		json.add("from", local_user);
+		json.add("to", remote_user);
+		json.add("result", res);
+		json.add("expected_cause_code", expected_cause_code);
+		json.add("cause_code", result_cause_code);
+		json.add("reason", reason);
+		json.add("callid", sip_call_id);
+		json.add("transport", transport);
+		json.add("peer_socket", peer_socket);
+		if (!tls_connection.empty())
+			json.add("tls_connection", tls_connection);
+		json.add("duration", connect_duration);
+		if (stage_us[VPS_INVITE] == 0) {
+			json.begin_object("setup_ms");
+			for (int i = VPS_100; i < VPS_COUNT; i++) {
+				if (stage_us[i] >= 0)
+					json.add(call_stage_names[i], stage_us[i] / 1000.0);
+			}
+			json.end_object();
+		}
+		json.add("expected_duration", expected_duration);
+		json.add("max_duration", max_duration);
+		json.add("hangup_duration", hangup_duration);
 		if (dtmf_recv.length() > 0)
-			result_line_json += ", \"dtmf_recv\": \""+dtmf_recv+"\"";
+			json.add("dtmf_recv", dtmf_recv);
 		if (rtp_stats && rtp_stats_ready)
-			result_line_json += "," + rtp_stats_json;
-		result_line_json += "}}";
-		config->result_file.write(result_line_json);
-		LOG(logINFO)<<"["<<now<<"]" << result_line_json;
-		config->result_file.flush();
+			json.add_raw("rtp_stats", rtp_stats_json);
+		if (detects()) {
+			json.begin_object("inband");
+			json.begin_array("tones");
+			for (const ToneReport::Tone &tone : detection.tones) {
+				json.begin_object();
+				json.add("freq", tone.freq);
+				json.add("first_ms", tone.first_ms);
+				json.add("duration_ms", tone.duration_ms);
+				json.end_object();
+			}
+			json.end_array();
+			json.add("dtmf", detection.dtmf());
+			json.begin_array("dtmf_ms");
+			for (const ToneReport::Digit &digit : detection.digits)
+				json.add_value((long long)digit.ms);
+			json.end_array();
+			json.end_object();
+		}
+		if (!rtp_series.empty()) {
+			json.begin_object("rtp_series");
+			json.add("interval_ms", rtp_stats_interval);
+			add_rtp_series(json, "rx_pkt", rtp_series, &RtpSample::rx_pkt);
+			add_rtp_series(json, "rx_loss", rtp_series, &RtpSample::rx_loss);
+			add_rtp_series(json, "rx_discard", rtp_series, &RtpSample::rx_discard);
+			add_rtp_series(json, "rx_jitter_ms", rtp_series, &RtpSample::rx_jitter_ms);
+			add_rtp_series(json, "tx_pkt", rtp_series, &RtpSample::tx_pkt);
+			add_rtp_series(json, "tx_loss", rtp_series, &RtpSample::tx_loss);
+			add_rtp_series(json, "rtt_ms", rtp_series, &RtpSample::rtt_ms);
+			json.end_object();
+		}
+		json.end_object();
+		config->result_file.write(json.str());
+		LOG(logINFO)<<"["<<now<<"]" << json.str();
 
 		LOG(logINFO)<<" ["<<type<<"]"<<endl;
 
@@ -492,16 +1004,6 @@ void Test::update_result() {
 		std::string td_style= "style='border-color:#98B4E5;border-style:solid;padding:3px;border-width:1px;'";
 		std::string td_hd_style = "style='border-color:#98B4E5;background-color: #EEF2F5;border-style:solid;padding:3px;border-width:1px;'";
 		std::string td_small_style="style='padding:1px;width:50%;border-style:solid;border-spacing:0px;border-width:1px;border-color:#98B4E5;text-align:center;font-size:8pt'";
-		if (config->testResults.size() == 0){
-			std::string headers = "<tr>"
-				"<td "+td_hd_style+">label</td>"
-				"<td "+td_hd_style+">start/end</td>"
-				"<td "+td_hd_style+">type</td><td "+td_hd_style+">result</td>"
-				"<td "+td_hd_style+">cause code</td><td "+td_hd_style+">reason</td>"
-				"<td "+td_hd_style+">duration</td>"
-				"<td "+td_hd_style+">from</td><td "+td_hd_style+">to</td>\r\n";
-			config->testResults.push_back(headers);
-		}
 		std::string mos_color = "green";
 		std::string code_color = "green";
 		if (expected_cause_code != result_cause_code)
@@ -527,20 +1029,322 @@ void Test::update_result() {
 			"<td "+td_style+">"+local_user+"</td>"
 			"<td "+td_style+">"+remote_user+"</td>"
 			"</tr>\r\n";
+		std::lock_guard<std::mutex> guard(config->results_mutex);
+		if (config->testResults.size() == 0){
+			std::string headers = "<tr>"
+				"<td "+td_hd_style+">label</td>"
+				"<td "+td_hd_style+">start/end</td>"
+				"<td "+td_hd_style+">type</td><td "+td_hd_style+">result</td>"
+				"<td "+td_hd_style+">cause code</td><td "+td_hd_style+">reason</td>"
+				"<td "+td_hd_style+">duration</td>"
+				"<td "+td_hd_style+">from</td><td "+td_hd_style+">to</td>\r\n";
+			config->testResults.push_back(headers);
+		}
 		config->testResults.push_back(result);
 }
 
 
 
+/*
+ * LoadGenerator implementation
+ */
+
+LoadGenerator::LoadGenerator(Config *config) : config(config) {
+	total = 1;
+	sps = 1.0;
+	channels = 0;
+	duration = 0;
+	made = 0;
+	active = 0;
+	running = false;
+	timer_scheduled = false;
+	pj_timer_entry_init(&timer, 0, this, &LoadGenerator::on_timer);
+}
+
+LoadGenerator::~LoadGenerator() {
+	std::lock_guard<std::mutex> guard(timer_lock);
+	if (timer_scheduled)
+		pjsua_cancel_timer(&timer);
+}
+
+void LoadGenerator::start() {
+	LOG(logINFO) <<__FUNCTION__<<": total["<<total<<"] sps["<<sps<<"] channels["<<channels<<"] duration["<<duration<<"] "<<describe();
+	running = true;
+	start_time = std::chrono::steady_clock::now();
+	run();
+}
+
+void LoadGenerator::ended() {
+	active--;
+	if (channels && running)
+		schedule(std::chrono::steady_clock::now());
+}
+
+void LoadGenerator::on_timer(pj_timer_heap_t *timer_heap, pj_timer_entry *entry) {
+	PJ_UNUSED_ARG(timer_heap);
+	LoadGenerator *generator = (LoadGenerator *) entry->user_data;
+	{
+		std::lock_guard<std::mutex> guard(generator->timer_lock);
+		generator->timer_scheduled = false;
+	}
+	generator->run();
+}
+
+void LoadGenerator::schedule(std::chrono::steady_clock::time_point when) {
+	std::lock_guard<std::mutex> guard(timer_lock);
+	if (timer_scheduled) {
+		if (timer_time <= when)
+			return;
+		pjsua_cancel_timer(&timer);
+	}
+	auto now = std::chrono::steady_clock::now();
+	long delay_ms = 0;
+	if (when > now)
+		delay_ms = (std::chrono::duration_cast<std::chrono::microseconds>(when - now).count() + 999) / 1000;
+	pj_time_val delay = {delay_ms / 1000, delay_ms % 1000};
+	timer_time = when;
+	timer_scheduled = (pjsua_schedule_timer(&timer, &delay) == PJ_SUCCESS);
+}
+
+void LoadGenerator::run() {
+	std::lock_guard<std::mutex> guard(lock);
+	if (!running)
+		return;
+	auto now = std::chrono::steady_clock::now();
+	std::chrono::nanoseconds next_call(0);
+	bool failed = false;
+	bool expired = duration && now - start_time >= std::chrono::seconds(duration);
+	// every one is due at start_time + n/sps, the timer only has a millisecond
+	// resolution so all the ones already due are made on each tick
+	while (!expired && (total == 0 || made < total)) {
+		if (channels && active >= channels)
+			break;
+		if (sps > 0)
+			next_call = std::chrono::nanoseconds((long long)(made * 1e9 / sps));
+		if (start_time + next_call > now)
+			break;
+		made++;
+		if (!make() && channels) {
+			failed = true;
+			break;
+		}
+	}
+	if (expired || (total && made >= total)) {
+		LOG(logINFO) <<__FUNCTION__<<": completed["<<made<<"] "<<describe();
+		running = false;
+		config->notifyWait();
+		return;
+	}
+	if (failed) {
+		// do not spin on a call that can not be made, e.g. too many calls
+		schedule(now + std::chrono::milliseconds(100));
+	} else if (!channels || active < channels) {
+		schedule(start_time + next_call);
+	} else if (duration) {
+		schedule(start_time + std::chrono::seconds(duration));
+	}
+	// else a call ending will start the next one
+}
+
+/*
+ * CallGenerator implementation
+ */
+
+CallGenerator::CallGenerator(Config *config, TestAccount *acc) : LoadGenerator(config), acc(acc) {
+	type = "call";
+	play = default_playback_file;
+	expected_cause_code = 200;
+	wait_until = INV_STATE_NULL;
+	min_mos = 0.0;
+	max_duration = 0;
+	max_calling_duration = 0;
+	expected_duration = 0;
+	hangup_duration = 0;
+	recording = false;
+	rtp_stats = false;
+	rtp_stats_interval = 0;
+	tls_no_reuse = false;
+}
+
+bool CallGenerator::make() {
+	Test *test = new Test(config, type);
+	test->wait_state = wait_until;
+	if (test->wait_state != INV_STATE_NULL)
+		test->set_state(VPT_RUN_WAIT);
+	test->expected_duration = expected_duration;
+	test->label = label;
+	test->play = play;
+	test->play_dtmf = play_dtmf;
+	test->min_mos = min_mos;
+	test->max_duration = max_duration;
+	test->max_calling_duration = max_calling_duration;
+	test->hangup_duration = hangup_duration;
+	test->recording = recording;
+	test->rtp_stats = rtp_stats;
+	test->rtp_stats_interval = rtp_stats_interval;
+	test->detect_tones = detect_tones;
+	test->detect_dtmf = detect_dtmf;
+	test->codecs = codecs;
+	test->tls_no_reuse = tls_no_reuse;
+	std::size_t pos = caller.find("@");
+	if (pos!=std::string::npos) {
+		test->local_user = caller.substr(0, pos);
+	}
+	pos = callee.find("@");
+	if (pos!=std::string::npos) {
+		test->remote_user = callee.substr(0, pos);
+	}
+
+	TestCall *call = new TestCall(acc);
+	config->addCall(acc, call);
+	active++;
+	WorkerCounters *counters = config->counters();
+	if (counters)
+		counters->calls++;
+	call->generator = this;
+
+	call->test = test;
+	test->expected_cause_code = expected_cause_code;
+	test->from = caller;
+	test->to = callee;
+	test->type = type;
+	CallOpParam prm(true);
+
+	for (auto x_hdr : x_headers) {
+		prm.txOption.headers.push_back(x_hdr);
+	}
+
+	prm.opt.audioCount = 1;
+	prm.opt.videoCount = 0;
+	LOG(logINFO) << "call->test:" << test << " " << call->test->type;
+	LOG(logINFO) << "calling :" +callee;
+	string uri = "sip:"+callee;
+	if (transport.compare("tls") == 0) {
+		uri = "sips:"+callee;
+	} else if (transport.compare("tcp") == 0) {
+		uri = "sip:"+callee+";transport=tcp";
+	}
+	bool success = true;
+	call->making_call = true;
+	try {
+		call->makeCall(uri, prm);
+	} catch (pj::Error e)  {
+		LOG(logERROR) <<__FUNCTION__<<" error :" << e.status << std::endl;
+		call->release_generator();
+		// no call state will ever complete this test
+		if (test->state != VPT_DONE) {
+			test->reason = e.reason;
+			test->mos_ready = true; // nothing to score
+			test->update_result();
+		}
+		success = false;
+	}
+	call->making_call = false;
+	if (!success || call->disconnected)
+		config->removeCall(call);
+	return success;
+}
+
+/*
+ * RegisterGenerator implementation
+ */
+
+RegisterGenerator::RegisterGenerator(Config *config) : LoadGenerator(config) {
+	range_first = 0;
+	range_last = -1;
+	range_width = 0;
+	succeeded = 0;
+	failed = 0;
+}
+
+static std::string expand_number(std::string value, int number, unsigned width) {
+	std::string digits = std::to_string(number);
+	if (digits.size() < width)
+		digits.insert(0, width - digits.size(), '0');
+	size_t pos;
+	while ((pos = value.find("{n}")) != std::string::npos)
+		value.replace(pos, 3, digits);
+	return value;
+}
+
+bool RegisterGenerator::make() {
+	// the workers take every worker_count-th account
+	unsigned n = (made - 1) * config->worker_count + config->worker_index;
+	RegisterParams reg;
+	if (!entries.empty()) {
+		reg = entries[n];
+	} else {
+		int number = range_first + n;
+		reg = params;
+		reg.username = expand_number(params.username, number, range_width);
+		reg.password = expand_number(params.password, number, range_width);
+		reg.account_name = expand_number(params.account_name.empty() ? params.username : params.account_name, number, range_width);
+	}
+	if (made == 1) {
+		std::lock_guard<std::mutex> guard(stats_lock);
+		first_sent = std::chrono::steady_clock::now();
+		last_log = first_sent;
+	}
+	if (!config->action.register_account(reg, this)) {
+		failed++;
+		return false;
+	}
+	return true;
+}
+
+void RegisterGenerator::registered(int code, uint64_t sent_ns) {
+	auto now = std::chrono::steady_clock::now();
+	latency.record((clock_mono_ns() - sent_ns) / 1000);
+	if (code / 100 == 2)
+		succeeded++;
+	else
+		failed++;
+	bool done = succeeded + failed >= (unsigned long)total;
+	std::lock_guard<std::mutex> guard(stats_lock);
+	if (done || now - last_log >= std::chrono::milliseconds(VP_WORKERS_STATS_MS)) {
+		last_log = now;
+		log_stats();
+	}
+}
+
+// stats_lock must be held
+void RegisterGenerator::log_stats() {
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - first_sent).count();
+	unsigned long answered = succeeded + failed;
+	LOG(logINFO) <<__FUNCTION__<<": [register] label["<<params.label<<"] sent["<<made<<"/"<<total<<"] registered["<<succeeded
+	             <<"] failed["<<failed<<"] rps["<<(seconds > 0 ? answered / seconds : 0)<<"] latency_ms p50["
+	             <<latency.percentile(50) / 1000.0<<"] p90["<<latency.percentile(90) / 1000.0<<"] p99["
+	             <<latency.percentile(99) / 1000.0<<"] max["<<latency.max() / 1000.0<<"]";
+}
+
+
 /*
  * ResultFile implementation
  */
 
-ResultFile::ResultFile(string name) : name(name) {
-	open();
+ResultFile::ResultFile(string name) : name(name), queue(4096), running(false), sleeping(false),
+                                      in_flight(0), key_count(0), shared_keys(nullptr), writer_done(false),
+                                      flush_count(0), flush_interval(0) {
+}
+
+ResultFile::~ResultFile() {
+	close();
+}
+
+void ResultFile::start(int p_flush_count, int p_flush_interval) {
+	if (running)
+		return;
+	if (!file.is_open())
+		open();
+	flush_count = p_flush_count;
+	flush_interval = p_flush_interval;
+	writer_done = false;
+	running = true;
+	writer = std::thread(&ResultFile::run, this);
+	LOG(logINFO) <<__FUNCTION__<<": result writer flush count["<<flush_count<<"] interval["<<flush_interval<<"ms]";
 }
 
-bool ResultFile::write(string res) {
+bool ResultFile::write_line(const string &res) {
 	try {
 		file << res << "\n";
 	} catch (Error & err) {
@@ -550,6 +1354,102 @@ bool ResultFile::write(string res) {
 	return true;
 }
 
+bool ResultFile::write(const string &result) {
+	// the key is taken and the line queued under key_lock, the keys are in file order
+	std::lock_guard<std::mutex> key_guard(key_lock);
+	char key[24];
+	if (shared_keys)
+		snprintf(key, sizeof(key), "%lu", ++shared_keys->result_seq);
+	else
+		snprintf(key, sizeof(key), "%lu", ++key_count);
+	string line;
+	line.reserve(result.size() + 32);
+	line.append("{\"").append(key).append("\": ").append(result).append("}");
+	// close() waits for the writes that saw the writer running before its last drain
+	in_flight++;
+	if (!running) {
+		in_flight--;
+		// no writer thread, or it is stopping
+		std::lock_guard<std::mutex> guard(lock);
+		bool ok = write_line(line);
+		file.flush();
+		return ok;
+	}
+	bool ok = true;
+	if (!queue.push(line)) {
+		// the writer is behind, wait for it instead of loosing results
+		LOG(logWARNING) <<__FUNCTION__<<": result queue full";
+		std::unique_lock<std::mutex> guard(lock);
+		// the writer drains holding the lock, retried under it the wakeup can not be missed
+		bool queued;
+		while (!(queued = queue.push(line)) && !writer_done) {
+			cond.notify_one();
+			space.wait(guard);
+		}
+		if (!queued) {
+			// the writer exited, close() drains the queue after this write
+			ok = write_line(line);
+			file.flush();
+		}
+	}
+	// pairs with the fence of the writer going to sleep
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (sleeping) {
+		std::lock_guard<std::mutex> guard(lock);
+		cond.notify_one();
+	}
+	in_flight--;
+	return ok;
+}
+
+void ResultFile::run() {
+	string line;
+	int pending = 0;
+	auto last_flush = std::chrono::steady_clock::now();
+	while (true) {
+		std::unique_lock<std::mutex> guard(lock);
+		bool stopping = !running;
+		while (queue.pop(line)) {
+			write_line(line);
+			pending++;
+			if (flush_count && pending >= flush_count) {
+				file.flush();
+				pending = 0;
+				last_flush = std::chrono::steady_clock::now();
+			}
+		}
+		space.notify_all();
+		auto now = std::chrono::steady_clock::now();
+		if (pending) {
+			bool flush_now = false;
+			if (!flush_count && !flush_interval)
+				flush_now = true; // flush every drained batch
+			else if (flush_interval && now - last_flush >= std::chrono::milliseconds(flush_interval))
+				flush_now = true;
+			if (flush_now) {
+				file.flush();
+				pending = 0;
+				last_flush = now;
+			}
+		}
+		if (stopping) {
+			writer_done = true;
+			space.notify_all();
+			break;
+		}
+		auto timeout = std::chrono::milliseconds(1000);
+		if (pending && flush_interval)
+			timeout = std::chrono::duration_cast<std::chrono::milliseconds>(last_flush + std::chrono::milliseconds(flush_interval) - now);
+		sleeping = true;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (queue.empty() && running)
+			cond.wait_for(guard, timeout);
+		sleeping = false;
+	}
+	std::lock_guard<std::mutex> guard(lock);
+	file.flush();
+}
+
 void ResultFile::flush() {
 	file.flush();
 }
@@ -562,10 +1462,32 @@ bool ResultFile::open() {
 		std::cerr <<__FUNCTION__<< " [error] test can not open log file :" << name ;
 		return false;
 	}
+	return true;
 }
 
 void ResultFile::close() {
-	file.close();
+	if (running) {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			running = false;
+			cond.notify_one();
+		}
+		// the writer drains the queue before exiting
+		writer.join();
+		// the writes still in progress end in the queue or in the file, never lost
+		while (in_flight)
+			std::this_thread::yield();
+		// results pushed while it was exiting
+		std::lock_guard<std::mutex> guard(lock);
+		string line;
+		while (queue.pop(line))
+			write_line(line);
+		file.flush();
+	}
+	// a write() that saw the writer running may still use the file
+	std::lock_guard<std::mutex> guard(lock);
+	if (file.is_open())
+		file.close();
 }
 
 
@@ -573,13 +1495,35 @@ void ResultFile::close() {
  * Config implementation
  */
 
-Config::Config(string result_fn) : result_file(result_fn), action(this) {
+Config::Config(string result_fn) : result_file(result_fn), action(this), register_refreshes(VP_WORKERS_STATS_MS / 1000) {
 		tls_cfg.ca_list = "tls/ca_list.pem";
 		tls_cfg.private_key = "tls/key.pem";
 		tls_cfg.certificate = "tls/certificate.pem";
 		tls_cfg.verify_server = 0;
 		tls_cfg.verify_client = 0;
-		json_result_count = 0;
+		media_call_seconds = 0;
+		capture_seconds = 60;
+		max_calls = 0;
+		packet_capture = nullptr;
+		register_refresh_failures = 0;
+		tls_connections_new = 0;
+		tls_connections_reused = 0;
+		worker_index = 0;
+		worker_count = 1;
+		shared_stats = nullptr;
+		media_cfg.threads = 0;
+		media_cfg.clock_rate = 0;
+		media_cfg.ptime = 0;
+		media_cfg.bridge = true;
+		tests_pending = 0;
+		tests_blocking = 0;
+}
+
+// the part of a call action load made by this worker, the first workers get the remainder
+int Config::workerShare(int n) {
+	if (worker_count <= 1 || n <= 0)
+		return n;
+	return n / worker_count + (worker_index < (unsigned)(n % worker_count) ? 1 : 0);
 }
 
 void Config::log(std::string message) {
@@ -587,14 +1531,70 @@ void Config::log(std::string message) {
 }
 
 Config::~Config() {
+	for (auto generator : generators)
+		delete generator;
 	result_file.close();
 }
 
+static void count_test(Config *config, Test *test, int n) {
+	if (test->state == VPT_DONE)
+		return;
+	config->tests_pending += n;
+	if (test->state == VPT_RUN_WAIT || test->type.compare("register") == 0)
+		config->tests_blocking += n;
+}
+
+void Config::addTest(Test *test) {
+	std::lock_guard<std::mutex> guard(wait_mutex);
+	count_test(this, test, 1);
+	wait_cond.notify_all();
+}
+
+void Config::removeTest(Test *test) {
+	std::lock_guard<std::mutex> guard(wait_mutex);
+	count_test(this, test, -1);
+	wait_cond.notify_all();
+}
+
+void Config::setTestState(Test *test, test_state_t state) {
+	std::lock_guard<std::mutex> guard(wait_mutex);
+	count_test(this, test, -1);
+	test->state = state;
+	count_test(this, test, 1);
+	wait_cond.notify_all();
+}
+
+void Config::notifyWait() {
+	std::lock_guard<std::mutex> guard(wait_mutex);
+	wait_cond.notify_all();
+}
+
+// wait_mutex must be held
+int Config::testsRunning(bool complete_all) {
+	int running = complete_all ? tests_pending : tests_blocking;
+	for (auto generator : generators) {
+		if (generator->is_running() && (complete_all || generator->blocking()))
+			running++;
+	}
+	return running;
+}
+
+void Config::addCall(TestAccount *acc, TestCall *call) {
+	std::lock_guard<std::mutex> guard(calls_mutex);
+	acc->calls.push_back(call);
+	calls.push_back(call);
+}
+
 void Config::removeCall(TestCall *call) {
-	for (auto it = calls.begin(); it != calls.end(); ++it) {
-		if (*it == call) {
-			calls.erase(it);
-			break;
+	{
+		std::lock_guard<std::mutex> guard(calls_mutex);
+		call->get_account()->removeCall(call);
+		for (auto it = calls.begin(); it != calls.end(); ++it) {
+			if (*it == call) {
+				*it = calls.back();
+				calls.pop_back();
+				break;
+			}
 		}
 	}
 	delete call;
@@ -608,31 +1608,179 @@ void Config::createDefaultAccount() {
 	LOG(logINFO) <<__FUNCTION__<<" created:"<<default_playback_file;
 }
 
-TestAccount* Config::createAccount(AccountConfig acc_cfg) {
+TestAccount* Config::createAccount(AccountConfig acc_cfg, Test *test) {
+	if (worker_count > 1) {
+		// disjoint RTP port ranges, the workers do not collide on each bind
+		unsigned range = ((65536 - VP_RTP_PORT) / worker_count) & ~1u;
+		acc_cfg.mediaConfig.transportConfig.port = VP_RTP_PORT + worker_index * range;
+		acc_cfg.mediaConfig.transportConfig.portRange = range;
+	}
 	TestAccount *account = new TestAccount();
-	accounts.push_back(account);
 	account->config = this;
-	account->create(acc_cfg);
-	AccountInfo acc_inf = account->getInfo();
-	LOG(logINFO) <<__FUNCTION__<< ": ["<< acc_inf.id << "]["<<acc_inf.uri<<"]";
+	account->test = test;
+	try {
+		account->create(acc_cfg);
+	} catch (Error &err) {
+		delete account;
+		throw;
+	}
+	{
+		std::lock_guard<std::mutex> guard(accounts_mutex);
+		accounts.push_back(account);
+		indexAccount(account, acc_cfg.idUri);
+	}
+	LOG(logINFO) <<__FUNCTION__<< ": ["<< account->getId() << "]["<<acc_cfg.idUri<<"]";
 	return account;
 }
 
-TestAccount* Config::findAccount(std::string account_name) {
-	if (account_name.compare(0, 1, "+") == 0)
-		account_name.erase(0,1);
-	for (auto account : accounts) {
-		AccountInfo acc_inf = account->getInfo();
-		int proto_length = 4; // "sip:"
-		if (acc_inf.uri.compare(0, 4, "sips") == 0)
-			proto_length = 5;
-		LOG(logINFO) <<__FUNCTION__<< ": [searching account]["<< acc_inf.id << "]["<<acc_inf.uri<<"]["<<acc_inf.uri.substr(proto_length)<<"]<>["<<account_name<<"]";
-		if (acc_inf.uri.compare(proto_length, account_name.length(), account_name) == 0 ) {
-			LOG(logINFO) <<__FUNCTION__<< ": found account id["<< acc_inf.id <<"] uri[" << acc_inf.uri <<"]";
-			return account;
+size_t Config::accountCount() {
+	std::lock_guard<std::mutex> guard(accounts_mutex);
+	return accounts.size();
+}
+
+void Config::modifyAccount(TestAccount *account, AccountConfig acc_cfg) {
+	account->modify(acc_cfg);
+	std::lock_guard<std::mutex> guard(accounts_mutex);
+	unindexAccount(account);
+	indexAccount(account, acc_cfg.idUri);
+}
+
+void Config::recordStages(const std::string &label, const long long *stage_us) {
+	StageLatency *latency;
+	{
+		std::lock_guard<std::mutex> guard(stage_mutex);
+		std::unique_ptr<StageLatency> &entry = stage_latency[label];
+		if (!entry)
+			entry.reset(new StageLatency());
+		latency = entry.get();
+	}
+	// the histograms are lock free, entries are only removed with the Config
+	for (int i = VPS_INVITE; i < VPS_COUNT; i++) {
+		if (stage_us[i] >= 0)
+			latency->stage[i].record(stage_us[i]);
+	}
+}
+
+/*
+ * One result line per label, after the tests: the calls counted and the
+ * percentiles of each stage in ms. Each worker writes its own lines.
+ */
+void Config::writeStageLatency() {
+	std::lock_guard<std::mutex> guard(stage_mutex);
+	JsonWriter json;
+	for (auto &it : stage_latency) {
+		const StageLatency &latency = *it.second;
+		json.clear();
+		json.begin_object();
+		json.add("label", it.first);
+		json.add("action", "stage_latency");
+		json.add("calls", (unsigned long long)latency.stage[VPS_INVITE].count());
+		if (worker_count > 1)
+			json.add("worker", worker_index);
+		for (int i = VPS_100; i < VPS_COUNT; i++) {
+			const LatencyHistogram &histogram = latency.stage[i];
+			if (histogram.count() == 0)
+				continue;
+			json.begin_object(call_stage_names[i]);
+			json.add("count", (unsigned long long)histogram.count());
+			json.add("p50", histogram.percentile(50) / 1000.0);
+			json.add("p90", histogram.percentile(90) / 1000.0);
+			json.add("p99", histogram.percentile(99) / 1000.0);
+			json.add("p99.9", histogram.percentile(99.9) / 1000.0);
+			json.add("max", histogram.max() / 1000.0);
+			json.end_object();
+			LOG(logINFO) <<__FUNCTION__<<": label["<<it.first<<"] "<<call_stage_names[i]<<"_ms count["<<histogram.count()
+			             <<"] p50["<<histogram.percentile(50) / 1000.0<<"] p90["<<histogram.percentile(90) / 1000.0
+			             <<"] p99["<<histogram.percentile(99) / 1000.0<<"] p99.9["<<histogram.percentile(99.9) / 1000.0<<"]";
 		}
+		json.end_object();
+		result_file.write(json.str());
 	}
-	return nullptr;
+}
+
+bool Config::tlsConnectionUsed(void *transport) {
+	std::lock_guard<std::mutex> guard(tls_mutex);
+	bool reused = !tls_connections.insert(transport).second;
+	if (reused)
+		tls_connections_reused++;
+	else
+		tls_connections_new++;
+	return reused;
+}
+
+// a later connection may get the same address
+void Config::tlsConnectionClosed(void *transport) {
+	std::lock_guard<std::mutex> guard(tls_mutex);
+	tls_connections.erase(transport);
+}
+
+/* account names are looked up without the scheme and the leading '+' */
+static std::string account_key(std::string name) {
+	if (name.compare(0, 4, "sip:") == 0)
+		name.erase(0, 4);
+	else if (name.compare(0, 5, "sips:") == 0)
+		name.erase(0, 5);
+	if (name.compare(0, 1, "+") == 0)
+		name.erase(0, 1);
+	return name;
+}
+
+// accounts_mutex must be held
+void Config::indexAccount(TestAccount *account, std::string uri) {
+	account->index_uri = account_key(uri);
+	account->index_user = account->index_uri.substr(0, account->index_uri.find("@"));
+	accounts_by_uri[account->index_uri] = account;
+	accounts_by_user.insert({account->index_user, account});
+}
+
+// accounts_mutex must be held
+void Config::unindexAccount(TestAccount *account) {
+	auto it = accounts_by_uri.find(account->index_uri);
+	if (it != accounts_by_uri.end() && it->second == account)
+		accounts_by_uri.erase(it);
+	it = accounts_by_user.find(account->index_user);
+	if (it != accounts_by_user.end() && it->second == account) {
+		accounts_by_user.erase(it);
+		for (auto other : accounts) {
+			if (other != account && other->index_user == account->index_user) {
+				accounts_by_user[other->index_user] = other;
+				break;
+			}
+		}
+	}
+}
+
+TestAccount* Config::findAccount(std::string account_name) {
+	account_name = account_key(account_name);
+	std::lock_guard<std::mutex> guard(accounts_mutex);
+	auto &index = account_name.find("@") == std::string::npos ? accounts_by_user : accounts_by_uri;
+	auto it = index.find(account_name);
+	if (it == index.end())
+		return nullptr;
+	LOG(logDEBUG) <<__FUNCTION__<< ": found account["<< account_name <<"] uri[" << it->second->index_uri <<"]";
+	return it->second;
+}
+
+unsigned Config::confClockRate() {
+	return media_cfg.clock_rate ? media_cfg.clock_rate : PJSUA_DEFAULT_CLOCK_RATE;
+}
+
+bool Config::loadMediaConfig(std::string p_configFileName) {
+	ezxml_t xml_conf = ezxml_parse_file(p_configFileName.c_str());
+	if (!xml_conf)
+		return false;
+	ezxml_t xml_media = ezxml_child(xml_conf, "media");
+	if (xml_media) {
+		const char *val;
+		if ((val = ezxml_attr(xml_media, "threads"))) media_cfg.threads = atoi(val);
+		if ((val = ezxml_attr(xml_media, "clock_rate"))) media_cfg.clock_rate = atoi(val);
+		if ((val = ezxml_attr(xml_media, "ptime"))) media_cfg.ptime = atoi(val);
+		if ((val = ezxml_attr(xml_media, "bridge"))) media_cfg.bridge = strcmp(val, "false") != 0 && strcmp(val, "0") != 0;
+		LOG(logINFO) <<__FUNCTION__<<": threads["<<media_cfg.threads<<"] clock_rate["<<media_cfg.clock_rate
+		             <<"] ptime["<<media_cfg.ptime<<"] bridge["<<media_cfg.bridge<<"]";
+	}
+	ezxml_free(xml_conf);
+	return true;
 }
 
 bool Config::process(std::string p_configFileName, std::string p_jsonResultFileName) {
@@ -799,15 +1947,154 @@ void VoipPatrolEnpoint::onSelectAccount(OnSelectAccountParam &param) {
 	pjsip_to_hdr* to_hdr = (pjsip_to_hdr*) pjsip_msg_find_hdr(pjsip_data->msg_info.msg, PJSIP_H_TO, NULL);
 	const pjsip_sip_uri* sip_uri = (pjsip_sip_uri*) pjsip_uri_get_uri(to_hdr->uri);
 	std::string to(sip_uri->user.ptr, sip_uri->user.slen);
-	LOG(logINFO) <<__FUNCTION__<<" to:" << to ;
+	LOG(logDEBUG) <<__FUNCTION__<<" to:" << to ;
 
 	TestAccount* account = config->findAccount(to);
 	if (!account) return;
 
-	AccountInfo acc_info = account->getInfo();
-	param.accountIndex = acc_info.id;
+	param.accountIndex = account->getId();
+}
+
+void VoipPatrolEnpoint::onTransportState(const OnTransportStateParam &prm) {
+	if (prm.state == PJSIP_TP_STATE_DISCONNECTED || prm.state == PJSIP_TP_STATE_DESTROY)
+		config->tlsConnectionClosed(prm.hnd);
+}
+
+
+// CPU used per second of connected call, to compare the media modes
+static void log_media_summary(Config *config, bool media_bridge) {
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+		return;
+	double cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+	long call_seconds = config->media_call_seconds;
+	LOG(logINFO) <<__FUNCTION__<<": [media] bridge["<<(media_bridge?"on":"off")<<"] cpu["<<cpu<<"s] call_seconds["<<call_seconds
+	             <<"] cpu_ms_per_call_second["<<(call_seconds ? cpu * 1000 / call_seconds : 0)<<"] pump_frames["<<config->media_pump.frames<<"]";
+	config->media_pump.log_stats();
+}
+
+// full TLS handshakes made compared to the tests sharing a connection
+static void log_tls_summary(Config *config) {
+	unsigned long created = config->tls_connections_new, reused = config->tls_connections_reused;
+	if (created + reused == 0)
+		return;
+	LOG(logINFO) <<__FUNCTION__<<": [tls] connections new["<<created<<"] reused["<<reused<<"] handshakes_per_test["
+	             <<(double)created / (created + reused)<<"]";
+}
+
+/*
+ * --workers: the supervisor forks the workers before pjsua is initialized,
+ * each one has its own SIP and RTP ports and makes its share of the calls,
+ * their results are appended to the result file once they all exited.
+ */
+static std::string worker_result_fn(const std::string &result_fn, unsigned index) {
+	return result_fn + ".worker" + std::to_string(index);
+}
+
+static void log_workers(SharedStats *stats, unsigned running) {
+	WorkerCounters total;
+	shared_stats_total(stats, &total);
+	LOG(logINFO) <<__FUNCTION__<<": [workers] running["<<running<<"/"<<stats->workers<<"] calls["<<total.calls
+	             <<"] results["<<total.results<<"] passed["<<total.passed<<"] failed["<<total.failed
+	             <<"] refreshes["<<total.refreshes<<"]";
+}
+
+static bool merge_results(const std::string &result_fn, unsigned workers) {
+	std::ofstream out(result_fn, std::ofstream::app);
+	if (!out.is_open()) {
+		LOG(logERROR) <<__FUNCTION__<<": can not open result file["<<result_fn<<"]";
+		return false;
+	}
+	for (unsigned i = 0; i < workers; i++) {
+		std::string fn = worker_result_fn(result_fn, i);
+		std::ifstream in(fn);
+		if (!in.is_open())
+			continue;
+		if (in.peek() != std::ifstream::traits_type::eof())
+			out << in.rdbuf();
+		in.close();
+		remove(fn.c_str());
+	}
+	out.flush();
+	return out.good();
 }
 
+static int supervise_workers(SharedStats *stats, const std::vector<pid_t> &pids, const std::string &result_fn) {
+	int ret = pids.size() == stats->workers ? 0 : 1;
+	unsigned running = pids.size();
+	auto last_report = std::chrono::steady_clock::now();
+	while (running) {
+		int status;
+		pid_t pid = waitpid(-1, &status, WNOHANG);
+		if (pid > 0) {
+			running--;
+			unsigned index = std::find(pids.begin(), pids.end(), pid) - pids.begin();
+			if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+				LOG(logINFO) <<__FUNCTION__<<": worker["<<index<<"] pid["<<pid<<"] completed";
+			} else {
+				LOG(logERROR) <<__FUNCTION__<<": worker["<<index<<"] pid["<<pid<<"] failed, status["<<status<<"]";
+				ret = 1;
+			}
+			continue;
+		}
+		if (pid < 0 && errno != EINTR)
+			break;
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		auto now = std::chrono::steady_clock::now();
+		if (now - last_report >= std::chrono::milliseconds(VP_WORKERS_STATS_MS)) {
+			log_workers(stats, running);
+			last_report = now;
+		}
+	}
+	log_workers(stats, running);
+	if (!merge_results(result_fn, stats->workers))
+		ret = 1;
+	return ret;
+}
+
+/*
+ * The call and socket limits are the ones of the pjsua build (include/config_site.h),
+ * the open files limit is raised to what they need when allowed.
+ */
+static bool check_scale_limits(Config *config) {
+	bool ok = true;
+	config->max_calls = pjsua_call_get_max_count();
+	std::string ioqueue = pj_ioqueue_name();
+	unsigned conf_ports = pjsua_conf_get_max_ports();
+	LOG(logINFO) <<__FUNCTION__<<": ioqueue["<<ioqueue<<"] max_handles["<<PJ_IOQUEUE_MAX_HANDLES<<"] max_calls["
+	             <<config->max_calls<<"] max_accounts["<<PJSUA_MAX_ACC<<"] max_conf_ports["<<conf_ports<<"]";
+#ifdef VP_HIGH_SCALE
+	if (ioqueue.find("epoll") == std::string::npos) {
+		LOG(logERROR) <<__FUNCTION__<<": built with VP_HIGH_SCALE but pjsua uses the "<<ioqueue<<" ioqueue, configure it with --enable-epoll";
+		ok = false;
+	}
+#endif
+	// an RTP and an RTCP socket per call
+	unsigned long sockets = (unsigned long)config->max_calls * 2;
+	if (sockets > PJ_IOQUEUE_MAX_HANDLES) {
+		LOG(logWARNING) <<__FUNCTION__<<": ioqueue max_handles["<<PJ_IOQUEUE_MAX_HANDLES<<"] below the sockets of max_calls["<<sockets<<"]";
+	}
+	// with the bridge, a port per call, player and recorder, and the sound device port
+	unsigned long ports = (unsigned long)config->max_calls + PJSUA_MAX_PLAYERS + PJSUA_MAX_RECORDERS + 1;
+	if (conf_ports < ports) {
+		LOG(logWARNING) <<__FUNCTION__<<": conference bridge max_ports["<<conf_ports<<"] below the ports of max_calls["<<ports
+		                <<"], raise PJSUA_MAX_CONF_PORTS";
+	}
+	// and the SIP transports, logs and results
+	rlim_t needed = sockets + 256;
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < needed) {
+		limit.rlim_cur = limit.rlim_max == RLIM_INFINITY ? needed : std::min(needed, limit.rlim_max);
+		setrlimit(RLIMIT_NOFILE, &limit);
+		getrlimit(RLIMIT_NOFILE, &limit);
+		if (limit.rlim_cur < needed) {
+			LOG(logWARNING) <<__FUNCTION__<<": open files limit["<<limit.rlim_cur<<"] below ["<<needed<<"], raise ulimit -n";
+		} else {
+			LOG(logINFO) <<__FUNCTION__<<": open files limit raised to ["<<limit.rlim_cur<<"]";
+		}
+	}
+	return ok;
+}
 
 int main(int argc, char **argv){
 	int ret = 0;
@@ -828,6 +2115,21 @@ int main(int argc, char **argv){
 	int port = 5070;
 	int log_level_console = 2;
 	int log_level_file = 10;
+	bool media_bridge = true;
+	int media_threads = -1;
+	int media_clock_rate = -1;
+	int media_ptime = -1;
+	bool bench_mos = false;
+	int mos_threads = std::thread::hardware_concurrency() / 2;
+	bool mos_threads_default = true;
+	int result_flush_count = 0;
+	int result_flush_interval = 0;
+	unsigned workers = 1;
+	int port_stride = 2;
+	std::string pcap_fn = "";
+	pcap_filter_t pcap_filter = PCAP_ALL;
+	unsigned pcap_sample = 100;
+	unsigned pcap_buffer = VP_PCAP_BUFFER;
 	Config config(log_test_fn);
 
 	ep.config = &config;
@@ -841,9 +2143,24 @@ int main(int argc, char **argv){
             " --log-level-file <0-10>           file log level            \n"\
             " --log-level-console <0-10>        console log level         \n"\
             " -p --port <5060>                  local port                \n"\
+            " --workers <N>                     worker processes sharing the load \n"\
+            " --port-stride <2>                 port offset between the workers \n"\
             " -c,--conf <conf.xml>              XML scenario file         \n"\
             " -l,--log <logfilename>            voip_patrol log file name \n"\
             " -o,--output <result.json>         json result file name     \n"\
+            " --result-flush-count <N>          flush results every N lines \n"\
+            " --result-flush-interval <ms>      flush pending results after ms \n"\
+            " --no-bridge                       media without conference bridge \n"\
+            " --media-threads <N>               media threads (pjsua, or media pump without bridge) \n"\
+            " --clock-rate <Hz>                 conference bridge clock rate \n"\
+            " --ptime <ms>                      codec and bridge frame ptime \n"\
+            " --mos-threads <N>                 min_mos scoring threads   \n"\
+            " --capture-seconds <N>             audio kept per call for min_mos/recording \n"\
+            " --bench-mos                       benchmark min_mos scoring and exit \n"\
+            " --pcap <file.pcap>                SIP and RTP capture       \n"\
+            " --pcap-filter <all|failed>        capture every call, or the failed calls only \n"\
+            " --pcap-sample <percent>           calls captured            \n"\
+            " --pcap-buffer <N>                 packets buffered for the pcap writer \n"\
             " --tls-calist <path/file_name>     TLS CA list (pem format)     \n"\
             " --tls-privkey <path/file_name>    TLS private key (pem format) \n"\
             " --tls-cert <path/file_name>       TLS certificate (pem format) \n"\
@@ -888,6 +2205,63 @@ int main(int argc, char **argv){
 			if (i + 1 < argc) {
 				log_test_fn = argv[++i];
 			}
+		} else if (arg == "--workers") {
+			if (i + 1 < argc) {
+				workers = atoi(argv[++i]);
+			}
+		} else if (arg == "--port-stride") {
+			if (i + 1 < argc) {
+				port_stride = atoi(argv[++i]);
+			}
+		} else if (arg == "--no-bridge") {
+			media_bridge = false;
+		} else if (arg == "--media-threads") {
+			if (i + 1 < argc) {
+				media_threads = atoi(argv[++i]);
+			}
+		} else if (arg == "--clock-rate") {
+			if (i + 1 < argc) {
+				media_clock_rate = atoi(argv[++i]);
+			}
+		} else if (arg == "--ptime") {
+			if (i + 1 < argc) {
+				media_ptime = atoi(argv[++i]);
+			}
+		} else if (arg == "--bench-mos") {
+			bench_mos = true;
+		} else if (arg == "--mos-threads") {
+			if (i + 1 < argc) {
+				mos_threads = atoi(argv[++i]);
+				mos_threads_default = false;
+			}
+		} else if (arg == "--capture-seconds") {
+			if (i + 1 < argc) {
+				config.capture_seconds = atoi(argv[++i]);
+			}
+		} else if (arg == "--pcap") {
+			if (i + 1 < argc) {
+				pcap_fn = argv[++i];
+			}
+		} else if (arg == "--pcap-filter") {
+			if (i + 1 < argc) {
+				pcap_filter = std::string(argv[++i]) == "failed" ? PCAP_FAILED : PCAP_ALL;
+			}
+		} else if (arg == "--pcap-sample") {
+			if (i + 1 < argc) {
+				pcap_sample = atoi(argv[++i]);
+			}
+		} else if (arg == "--pcap-buffer") {
+			if (i + 1 < argc) {
+				pcap_buffer = atoi(argv[++i]);
+			}
+		} else if (arg == "--result-flush-count") {
+			if (i + 1 < argc) {
+				result_flush_count = atoi(argv[++i]);
+			}
+		} else if (arg == "--result-flush-interval") {
+			if (i + 1 < argc) {
+				result_flush_interval = atoi(argv[++i]);
+			}
 		}
 	}
 
@@ -904,19 +2278,107 @@ int main(int argc, char **argv){
 		"output file: "<<log_test_fn<<"\n"
 		"* * * * * * *\n";
 
+	if (bench_mos)
+		return mos_benchmark("voice_ref_files/reference_8000_12s.wav");
+
+	if (workers == 0)
+		workers = 1;
+	if (workers > 1) {
+		SharedStats *stats = shared_stats_create(workers);
+		if (!stats) {
+			LOG(logERROR) <<__FUNCTION__<<": invalid workers["<<workers<<"], max["<<VP_MAX_WORKERS<<"]";
+			return 1;
+		}
+		// nothing buffered may be written twice by the children
+		std::cout.flush();
+		fflush(NULL);
+		std::vector<pid_t> pids;
+		int index = -1;
+		for (unsigned i = 0; i < workers; i++) {
+			pid_t pid = fork();
+			if (pid == 0) {
+				index = i;
+				break;
+			}
+			if (pid < 0) {
+				LOG(logERROR) <<__FUNCTION__<<": fork of worker["<<i<<"] failed: "<<strerror(errno);
+				break;
+			}
+			pids.push_back(pid);
+		}
+		if (index < 0) {
+			ret = supervise_workers(stats, pids, log_test_fn);
+			shared_stats_destroy(stats);
+			return ret;
+		}
+		stats->worker[index].pid = getpid();
+		config.worker_index = index;
+		config.worker_count = workers;
+		config.shared_stats = stats;
+		config.result_file.set_shared_keys(stats);
+		port += index * port_stride;
+		log_test_fn = worker_result_fn(log_test_fn, index);
+		if (log_fn.length() > 0) {
+			FILE* log_fd = fopen((log_fn + "." + std::to_string(index)).c_str(), "w");
+			if (log_fd)
+				Output2FILE::Stream() = log_fd;
+		}
+		LOG(logINFO) <<__FUNCTION__<<": worker["<<index<<"/"<<workers<<"] port["<<port<<"] output["<<log_test_fn<<"]";
+	}
+	config.result_file.set_name(log_test_fn);
+
+	// the scenario media settings, the command line has the last word
+	config.loadMediaConfig(conf_fn);
+	if (media_threads >= 0) config.media_cfg.threads = media_threads;
+	if (media_clock_rate >= 0) config.media_cfg.clock_rate = media_clock_rate;
+	if (media_ptime >= 0) config.media_cfg.ptime = media_ptime;
+	if (!media_bridge) config.media_cfg.bridge = false;
+	media_bridge = config.media_cfg.bridge;
+
+	config.result_file.start(result_flush_count, result_flush_interval);
+	if (mos_threads_default)
+		mos_threads /= workers;
+	config.mos_pool.start(mos_threads > 0 ? mos_threads : 1);
+
+	// the packet slots are only allocated when the capture is enabled
+	PacketCapture packet_capture(pcap_fn.length() > 0 ? (pcap_buffer ? pcap_buffer : VP_PCAP_BUFFER) : 0);
+
 	TransportConfig tcfg;
 	try {
 		ep.libCreate();
 		EpConfig ep_cfg;
-		ep_cfg.uaConfig.maxCalls = 1000;
+		ep_cfg.uaConfig.maxCalls = PJSUA_MAX_CALLS;
 		ep_cfg.logConfig.level = log_level_file;
 		ep_cfg.logConfig.consoleLevel = log_level_console;
 		std::string pj_log_fn =  "pjsua_" + std::to_string(port) + ".log";
 		ep_cfg.logConfig.filename = pj_log_fn.c_str();
 		ep_cfg.medConfig.ecTailLen = 0; // disable echo canceller
 		ep_cfg.medConfig.noVad = 1;
+		if (config.media_cfg.threads > 0)
+			ep_cfg.medConfig.threadCnt = config.media_cfg.threads;
+		if (config.media_cfg.clock_rate) {
+			ep_cfg.medConfig.clockRate = config.media_cfg.clock_rate;
+			ep_cfg.medConfig.sndClockRate = config.media_cfg.clock_rate;
+		}
+		if (config.media_cfg.ptime) {
+			ep_cfg.medConfig.audioFramePtime = config.media_cfg.ptime;
+			ep_cfg.medConfig.ptime = config.media_cfg.ptime;
+		}
 
 		ep.libInit( ep_cfg );
+		if (!check_scale_limits(&config)) {
+			ep.libDestroy();
+			return 1;
+		}
+		if (pcap_fn.length() > 0) {
+			if (config.worker_count > 1)
+				pcap_fn = worker_result_fn(pcap_fn, config.worker_index);
+			if (!packet_capture.start(pcap_fn, pcap_filter, pcap_sample)) {
+				ep.libDestroy();
+				return 1;
+			}
+			config.packet_capture = &packet_capture;
+		}
 		// pjsua_set_null_snd_dev() before calling pjsua_start().
 
 		// TCP and UDP transports
@@ -952,6 +2414,13 @@ int main(int argc, char **argv){
 		// load config and execute test
 		pjsua_set_null_snd_dev();
 		ep.libStart();
+		if (!media_bridge) {
+			unsigned threads = config.media_cfg.threads > 0 ? config.media_cfg.threads : std::thread::hardware_concurrency() / workers;
+			if (!config.media_pump.start(threads ? threads : 1)) {
+				LOG(logERROR) <<__FUNCTION__<<": media pump not started, using the conference bridge";
+				media_bridge = true;
+			}
+		}
 
 		config.createDefaultAccount();
 		config.process(conf_fn, log_test_fn);
@@ -961,6 +2430,10 @@ int main(int argc, char **argv){
 		config.action.set_param_by_name(&params, "complete");
 		config.action.do_wait(params);
 
+		log_media_summary(&config, media_bridge);
+		log_tls_summary(&config);
+		config.writeStageLatency();
+
 		LOG(logINFO) <<__FUNCTION__<<": checking alerts...";
 
 		// send email reporting
@@ -969,6 +2442,8 @@ int main(int argc, char **argv){
 
 		LOG(logINFO) <<__FUNCTION__<<": hangup all calls..." ;
 		ep.hangupAllCalls();
+		config.media_pump.stop();
+		config.mos_pool.stop();
 
 		ret = PJ_SUCCESS;
 	} catch (Error &err) {
@@ -983,6 +2458,9 @@ int main(int argc, char **argv){
 		LOG(logINFO) <<__FUNCTION__<<": Exception: " << err.info() ;
 		ret = 1;
 	}
+	// after the last calls are released by pjsua
+	packet_capture.stop();
+	config.packet_capture = nullptr;
 
 	if (ret == PJ_SUCCESS) {
 		LOG(logINFO) <<__FUNCTION__<<": Success" ;
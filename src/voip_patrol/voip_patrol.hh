@@ -23,14 +23,30 @@
 #include <iostream>
 #include <fstream>
 #include <memory>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <thread>
 #include <pj/file_access.h>
 #include "ezxml/ezxml.h"
+#include "ring_queue.hh"
+#include "media.hh"
+#include "mos.hh"
+#include "stats.hh"
+#include "pcap.hh"
 #include "curl/email.h"
 #include <sstream>
 #include <ctime>
 #include "log.h"
+#include "clock.h"
 #include "version.h"
 
+#define VP_RTP_PORT 4000 // pjsua default, first RTP port of the accounts
+
 #define LOG_COLOR_INFO "\e[1;35m"
 #define LOG_COLOR_ERROR "\e[1;31m"
 #define LOG_COLOR_END "\e[0m\n"
@@ -41,6 +57,9 @@ class TestAccount;
 class TestCall;
 class Test;
 class Config;
+class LoadGenerator;
+class CallGenerator;
+class RegisterGenerator;
 
 typedef struct upload_data {
 	int lines_read;
@@ -68,13 +87,59 @@ class Alert {
 class ResultFile {
 	public:
 		ResultFile(std::string file_name);
+		~ResultFile();
+		// the file is opened by start()
+		void set_name(const std::string &file_name) { name = file_name; }
 		void flush();
 		bool open();
 		void close();
-		bool write(std::string res);
+		void start(int flush_count, int flush_interval);
+		// with --workers the keys come from the shared segment, unique across the workers
+		void set_shared_keys(SharedStats *stats) { shared_keys = stats; }
+		// result: JSON object, written as {"<key>": result}, the key is taken when it is queued
+		bool write(const std::string &result);
 	private:
+		void run();
+		bool write_line(const std::string &res);
 		std::fstream file;
 		std::string name;
+		RingQueue<std::string> queue;
+		std::thread writer;
+		std::mutex lock;                  // file access outside of the writer thread, writer sleep
+		std::condition_variable cond;
+		std::condition_variable space;    // the writer drained the queue, or exited
+		std::atomic<bool> running;
+		std::atomic<bool> sleeping;
+		std::atomic<int> in_flight;       // write() calls that saw the writer running
+		std::mutex key_lock;              // keys are taken and queued in the same order
+		unsigned long key_count;
+		SharedStats *shared_keys;
+		bool writer_done;                 // under lock, the writer made its last drain
+		int flush_count;                  // flush every N results, 0: disabled
+		int flush_interval;               // flush pending results after N ms, 0: disabled
+};
+
+typedef enum test_run_state {
+	VPT_RUN,              // test is running
+	VPT_RUN_WAIT,         // test is running and will block execution when command wait is used
+	VPT_DONE              // test is completed
+} test_state_t;
+
+// signalling stages of a call, the time of each one is measured from the INVITE
+typedef enum call_stage {
+	VPS_INVITE,           // sent, or received by accept
+	VPS_100,
+	VPS_18X,              // first provisional response 180 to 189
+	VPS_200,              // any 2xx
+	VPS_ACK,              // sent, or received by accept
+	VPS_COUNT
+} call_stage_t;
+
+extern const char *call_stage_names[VPS_COUNT];
+
+// per label distributions of the stage times, us
+struct StageLatency {
+	LatencyHistogram stage[VPS_COUNT];
 };
 
 class Config {
@@ -83,26 +148,74 @@ class Config {
 		~Config();
 		void log(std::string message);
 		bool process(std::string ConfigFileName, std::string jsonResultFile);
+		// <media> element, read before pjsua is initialized
+		bool loadMediaConfig(std::string configFileName);
+		unsigned confClockRate();
 		bool wait(bool complete_all);
 		TestAccount* findAccount(std::string);
-		TestAccount* createAccount(AccountConfig acc_cfg);
+		// the test is set before the account sends its first REGISTER
+		TestAccount* createAccount(AccountConfig acc_cfg, Test *test=nullptr);
+		size_t accountCount();
+		void modifyAccount(TestAccount *acc, AccountConfig acc_cfg);
 		void createDefaultAccount();
+		void addCall(TestAccount *acc, TestCall *call);
 		std::vector<TestAccount *> accounts;
 		std::vector<TestCall *> calls;
+		std::mutex calls_mutex; // calls are added from the pjsip threads
+		std::vector<LoadGenerator *> generators;
+		// wait action, signaled when a test changes state
+		std::mutex wait_mutex;
+		std::condition_variable wait_cond;
+		void addTest(Test *test);
+		void removeTest(Test *test);
+		void setTestState(Test *test, test_state_t state);
+		void notifyWait();
+		int testsRunning(bool complete_all);
+		int tests_pending;  // tests not completed
+		int tests_blocking; // tests in run_wait and registrations
 		std::vector<Test *> tests;
 		std::vector<std::string> testResults;
+		std::mutex results_mutex;
 		ezxml_t xml_conf_head;
 		ezxml_t xml_test;
 		void removeCall(TestCall *call);
+		// a TLS connection is new for the first test using it, reused afterwards
+		bool tlsConnectionUsed(void *transport);
+		void tlsConnectionClosed(void *transport);
+		std::atomic<unsigned long> tls_connections_new;
+		std::atomic<unsigned long> tls_connections_reused;
+		RateMeter register_refreshes;            // made by pjsua, logged every VP_WORKERS_STATS_MS
+		std::atomic<unsigned long> register_refresh_failures; // refreshes answered with an error
+		// stage times of the calls and accepts, written per label at the end of the run
+		void recordStages(const std::string &label, const long long *stage_us);
+		void writeStageLatency();
 		std::string alert_email_to;
 		std::string alert_email_from;
 		std::string alert_server_url;
 		TransportId transport_id_udp;
 		TransportId transport_id_tcp;
 		TransportId transport_id_tls;
-		int json_result_count;
 		Action action;
 		ResultFile result_file;
+		PlaybackCache playback_cache;
+		MediaPump media_pump;                    // running in bridge-less mode only
+		MosPool mos_pool;
+		std::atomic<long> media_call_seconds;
+		unsigned capture_seconds;                // received audio kept in memory per call
+		unsigned max_calls;                      // pjsua call limit, known once pjsua is initialized
+		PacketCapture *packet_capture;           // --pcap, nullptr when the capture is off
+		// --workers: this process runs its share of the load, 0 and 1 otherwise
+		unsigned worker_index;
+		unsigned worker_count;
+		SharedStats *shared_stats;               // nullptr without workers
+		WorkerCounters * counters() { return shared_stats ? &shared_stats->worker[worker_index] : nullptr; }
+		int workerShare(int n);
+		struct {
+			int threads;         // pjsua media threads, and media pump threads without the bridge, 0: default
+			unsigned clock_rate; // conference bridge clock rate, 0: pjsua default
+			unsigned ptime;      // codec and bridge frame ptime, 0: pjsua default
+			bool bridge;
+		} media_cfg;
 		struct {
 			string ca_list;
 			string private_key;
@@ -110,8 +223,16 @@ class Config {
 			int verify_server;
 			int verify_client;
 		} tls_cfg;
-		std::vector<Test *> tests_with_rtp_stats;
 	private:
+		void indexAccount(TestAccount *acc, std::string uri);
+		void unindexAccount(TestAccount *acc);
+		std::mutex accounts_mutex;
+		std::unordered_map<std::string, TestAccount *> accounts_by_uri;  // user@host
+		std::unordered_map<std::string, TestAccount *> accounts_by_user; // user, first account created
+		std::mutex stage_mutex;
+		std::map<std::string, std::unique_ptr<StageLatency>> stage_latency;
+		std::mutex tls_mutex;
+		std::unordered_set<void *> tls_connections;
 		std::string configFileName;
 };
 
@@ -130,16 +251,23 @@ string get_call_state_string (call_state_t state);
 
 const char default_playback_file[] = "voice_ref_files/reference_8000.wav";
 
-typedef enum test_run_state {
-	VPT_RUN,              // test is running
-	VPT_RUN_WAIT,         // test is running and will block execution when command wait is used
-	VPT_DONE              // test is completed
-} test_state_t;
+/* RTP counters of one sampling interval, the jitter and rtt are the last values seen */
+struct RtpSample {
+	unsigned rx_pkt {0};
+	unsigned rx_loss {0};
+	unsigned rx_discard {0};
+	unsigned tx_pkt {0};
+	unsigned tx_loss {0};   // as reported by the peer
+	unsigned rx_jitter_ms {0};
+	unsigned rtt_ms {0};
+};
 
 class Test {
 	public:
 		Test(Config *config, string type);
+		~Test();
 		std::string type;
+		void set_state(test_state_t state);
 		void update_result(void);
 		std::string from;
 		std::string to;
@@ -161,6 +289,10 @@ class Test {
 		int ring_duration;
 		int max_calling_duration;
 		void get_mos();
+		// the received audio is captured or goes through the tone detector
+		bool listens() const { return min_mos > 0 || recording || detects(); }
+		bool detects() const { return !detect_tones.empty() || !detect_dtmf.empty(); }
+		bool check_detection();
 		std::string local_user;
 		std::string remote_user;
 		std::string call_direction;
@@ -168,6 +300,8 @@ class Test {
 		std::string label;
 		std::string transport;
 		std::string peer_socket;
+		std::string tls_connection;          // "new" or "reused", TLS only
+		bool tls_no_reuse;                   // the connection is shut down when the call ends
 		std::string dtmf_recv;
 		call_state_t wait_state;
 		test_state_t state;
@@ -175,12 +309,30 @@ class Test {
 		bool recording;
 		bool playing;
 		string record_fn;
+		std::shared_ptr<AudioClip> capture; // received audio, set when the call is disconnected
 		string reference_fn;
+		bool mos_ready;
 		string rtp_stats_json;
+		int rtp_stats_interval;              // ms, 0: no time series
+		std::vector<RtpSample> rtp_series;
+		std::vector<unsigned> detect_tones;  // Hz, expected in the received audio
+		std::vector<std::string> codecs;     // offered or answered, in this order
+		std::string detect_dtmf;             // in-band digits expected in the received audio
+		ToneReport detection;
+		bool detection_ready;
 		string play;
 		string play_dtmf;
 		bool rtp_stats_ready;
 		bool queued;
+		RegisterGenerator *register_generator; // bulk registration the test is part of
+		uint64_t register_ns;                // REGISTER sent, clock_mono_ns
+		void stage_reached(call_stage_t stage);
+		long long stage_us[VPS_COUNT];       // since the INVITE, -1: not reached
+		uint64_t invite_ns;                  // clock_mono_ns
+		// ms since the epoch, answer_ms is 0 until a 2xx is received or sent
+		uint64_t start_ms;
+		uint64_t end_ms;
+		uint64_t answer_ms;
 	private:
 		Config *config;
 };
@@ -190,6 +342,7 @@ class VoipPatrolEnpoint : public Endpoint {
 		Config *config;
 	private:
 		void onSelectAccount(OnSelectAccountParam &param);
+		void onTransportState(const OnTransportStateParam &prm);
 };
 
 class TestAccount : public Account {
@@ -207,10 +360,19 @@ class TestAccount : public Account {
 		int max_duration;
 		int ring_duration;
 		bool rtp_stats;
+		int rtp_stats_interval;
+		bool recording;
+		float min_mos;
+		std::vector<unsigned> detect_tones;
+		std::string detect_dtmf;
+		std::vector<std::string> codecs;
+		bool tls_no_reuse;
 		string play;
 		string play_dtmf;
 		call_state_t wait_state;
 		std::string accept_label;
+		std::string index_uri;  // user@host key in the account index
+		std::string index_user; // user key in the account index
 		string reason;
 		int code;
 		int expected_cause_code;
@@ -225,17 +387,144 @@ class TestCall : public Call {
 		virtual void onCallRxOffer(OnCallTsxStateParam &prm);
 		virtual void onCallTsxState(OnCallTsxStateParam &prm);
 		virtual void onCallState(OnCallStateParam &prm);
+		virtual void onCallSdpCreated(OnCallSdpCreatedParam &prm);
 		virtual void onStreamCreated(OnStreamCreatedParam &prm);
 		virtual void onStreamDestroyed(OnStreamDestroyedParam &prm);
 		virtual void onDtmfDigit(OnDtmfDigitParam &prm);
-		pjsua_recorder_id recorder_id;
+		virtual void onCreateMediaTransport(OnCreateMediaTransportParam &prm);
 		pjsua_player_id player_id;
+		PlaybackPort *playback;
+		CaptureSink *capture;
+		MediaLink *media_link;   // bridge-less mode only
+		void release_media();
+		std::atomic<CallGenerator *> generator;
+		void release_generator();
+		void schedule_timer(int msec);
+		void cancel_timer();
+		void get_rtp_stats(unsigned stream_idx);
+		void collect_detection();
+		void schedule_rtp_sampler();
+		void track_transport(pjsip_transport *transport);
+		void filter_answer_codecs(pjsip_rx_data *rdata);
+		TestAccount *get_account() { return acc; }
+		bool making_call;   // makeCall in progress, the call can not be deleted
+		bool disconnected;
 		int role;
 		int rtt;
 	private:
+		static void on_timer(pj_timer_heap_t *timer_heap, pj_timer_entry *entry);
+		void handle_timer();
+		pj_timer_entry timer; // ring, cancel or hangup, depending on the call state
+		static void on_rtp_sampler(pj_timer_heap_t *timer_heap, pj_timer_entry *entry);
+		void sample_rtp_stats();
+		pj_timer_entry rtp_sampler;
+		RtpSample rtp_totals; // counters at the previous sample
+		pjsip_transport *sip_transport; // TLS connection of the call, referenced
+		std::atomic<uint64_t> *capture_key; // --pcap, owned by the media transport adapter
 		TestAccount *acc;
 
 };
 
+/*
+ * Paces the calls or registrations of one action, they are issued on an absolute
+ * schedule driven by a pjsua timer, this way the rate does not drift and the
+ * scenario is not blocked while they are made. The subclasses make one at a time.
+ */
+class LoadGenerator {
+	public:
+		LoadGenerator(Config *config);
+		virtual ~LoadGenerator();
+		void start();
+		bool is_running() { return running; }
+		// a wait action without complete returns when the generator is done
+		virtual bool blocking() { return false; }
+		// load parameters
+		int total;     // amount to make, 0 for no limit with channels
+		float sps;     // per second, <= 0 to make all of them at once
+		int channels;  // amount kept in progress, 0 to disable
+		int duration;  // seconds after which no more are made, 0 for no limit
+		void ended();  // one in progress has ended
+	protected:
+		// the one to make is number made - 1, false when it could not be made
+		virtual bool make() = 0;
+		virtual std::string describe() = 0;
+		Config *config;
+		std::atomic<int> active;
+		std::atomic<int> made;
+	private:
+		static void on_timer(pj_timer_heap_t *timer_heap, pj_timer_entry *entry);
+		void run();
+		void schedule(std::chrono::steady_clock::time_point when);
+		pj_timer_entry timer;
+		std::mutex timer_lock;
+		bool timer_scheduled;
+		std::chrono::steady_clock::time_point timer_time;
+		std::mutex lock;
+		std::chrono::steady_clock::time_point start_time;
+		std::atomic<bool> running;
+};
+
+/* originates the calls of one call action */
+class CallGenerator : public LoadGenerator {
+	public:
+		CallGenerator(Config *config, TestAccount *acc);
+		bool blocking() { return wait_until != INV_STATE_NULL; }
+		// parameters of the generated calls
+		std::string type;
+		std::string play;
+		std::string play_dtmf;
+		std::string caller;
+		std::string callee;
+		std::string transport;
+		std::string label;
+		int expected_cause_code;
+		call_state_t wait_until;
+		float min_mos;
+		int max_duration;
+		int max_calling_duration;
+		int expected_duration;
+		int hangup_duration;
+		bool recording;
+		bool rtp_stats;
+		int rtp_stats_interval;
+		std::vector<unsigned> detect_tones;
+		std::string detect_dtmf;
+		std::vector<std::string> codecs;
+		bool tls_no_reuse;
+		SipHeaderVector x_headers;
+		void call_ended() { ended(); }
+	private:
+		bool make();
+		std::string describe() { return "calls callee[" + callee + "]"; }
+		TestAccount *acc;
+};
+
+/*
+ * Registers the accounts of a register action with a range or a file, each
+ * account is then refreshed by pjsua. The REGISTER to final response latency
+ * of every account is kept in a histogram.
+ */
+class RegisterGenerator : public LoadGenerator {
+	public:
+		RegisterGenerator(Config *config);
+		bool blocking() { return true; }
+		RegisterParams params;            // {n} in username, account and password is replaced
+		int range_first;
+		int range_last;
+		unsigned range_width;             // zero padding of {n}
+		std::vector<RegisterParams> entries; // from the file, made in place of the range
+		void registered(int code, uint64_t sent_ns);
+		void log_stats();
+	private:
+		bool make();
+		std::string describe() { return "registrations label[" + params.label + "]"; }
+		std::chrono::steady_clock::time_point first_sent;
+		std::atomic<unsigned long> succeeded;
+		std::atomic<unsigned long> failed;
+		LatencyHistogram latency;
+		std::mutex stats_lock;
+		std::chrono::steady_clock::time_point last_log;
+};
+
 
 #endif